@@ -27,6 +27,8 @@ namespace ravl
       virtual ~Claims() = default;
 
       UvmEndorsements uvm_endorsements;
+
+      virtual std::shared_ptr<ravl::Claims> clone() const override;
     };
 
     class Attestation : public ravl::sev_snp::Attestation 
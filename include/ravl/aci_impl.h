@@ -21,6 +21,11 @@ namespace ravl
 {
   namespace aci
   {
+    RAVL_VISIBILITY std::shared_ptr<ravl::Claims> Claims::clone() const
+    {
+      return std::make_shared<Claims>(*this);
+    }
+
     RAVL_VISIBILITY std::shared_ptr<ravl::Claims> Attestation::verify(
       const Options& options,
       const std::optional<std::vector<HTTPResponse>>& http_responses) const
@@ -58,6 +58,13 @@ namespace ravl
 
     /// Conversion to JSON format
     virtual std::string to_json() const = 0;
+
+    /// Deep copy (nullptr if the claims cannot be copied, in which case
+    /// verdicts with these claims are not cached)
+    virtual std::shared_ptr<Claims> clone() const
+    {
+      return nullptr;
+    }
   };
 
   /// Attestation class
@@ -103,6 +110,14 @@ namespace ravl
       const Options& options = {},
       const std::optional<HTTPResponses>& http_responses = {}) const = 0;
 
+    /// Identifier of the platform (e.g. SGX FMSPC) whose endorsements are
+    /// used to verify the attestation (empty if verdicts for the attestation
+    /// are not cacheable)
+    virtual std::string platform_id() const
+    {
+      return "";
+    }
+
     /// (JSON) String representation
     operator std::string() const;
 
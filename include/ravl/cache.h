@@ -0,0 +1,133 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+
+namespace ravl
+{
+  /// Thread-safe key/value cache with per-entry expiry times and an optional
+  /// bound on the number of entries (least recently used entries are evicted
+  /// first).
+  template <typename K, typename V>
+  class ExpiringCache
+  {
+  public:
+    using Clock = std::chrono::system_clock;
+
+    /// Constructor (max_entries_ = 0 means no limit)
+    ExpiringCache(size_t max_entries_ = 0) : max_entries(max_entries_) {}
+
+    virtual ~ExpiringCache() = default;
+
+    /// Find an entry that has not expired yet.
+    std::optional<V> find(const K& key)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto it = entries.find(key);
+      if (it == entries.end())
+        return std::nullopt;
+
+      if (it->second.expiry <= Clock::now())
+      {
+        lru.erase(it->second.lru_it);
+        entries.erase(it);
+        return std::nullopt;
+      }
+
+      lru.splice(lru.begin(), lru, it->second.lru_it);
+      return it->second.value;
+    }
+
+    /// Insert or replace an entry.
+    void insert(const K& key, const V& value, Clock::time_point expiry)
+    {
+      if (expiry <= Clock::now())
+        return;
+
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto it = entries.find(key);
+      if (it != entries.end())
+      {
+        it->second.value = value;
+        it->second.expiry = expiry;
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        return;
+      }
+
+      lru.push_front(key);
+      entries.emplace(key, Entry{value, expiry, lru.begin()});
+
+      if (max_entries != 0 && entries.size() > max_entries)
+      {
+        entries.erase(lru.back());
+        lru.pop_back();
+      }
+    }
+
+    /// Remove an entry.
+    void erase(const K& key)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto it = entries.find(key);
+      if (it != entries.end())
+      {
+        lru.erase(it->second.lru_it);
+        entries.erase(it);
+      }
+    }
+
+    /// Remove all entries.
+    void clear()
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      entries.clear();
+      lru.clear();
+    }
+
+    /// Remove all expired entries.
+    void purge()
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      auto now = Clock::now();
+      for (auto it = entries.begin(); it != entries.end();)
+      {
+        if (it->second.expiry <= now)
+        {
+          lru.erase(it->second.lru_it);
+          it = entries.erase(it);
+        }
+        else
+          it++;
+      }
+    }
+
+    /// Number of entries (including expired ones that have not been purged)
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      return entries.size();
+    }
+
+  protected:
+    struct Entry
+    {
+      V value;
+      Clock::time_point expiry;
+      typename std::list<K>::iterator lru_it;
+    };
+
+    mutable std::mutex mtx;
+    size_t max_entries = 0;
+    std::map<K, Entry> entries;
+    std::list<K> lru;
+  };
+}
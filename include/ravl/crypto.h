@@ -3,11 +3,14 @@
 
 #pragma once
 
+#include "cache.h"
 #include "crypto_options.h"
 #include "util.h"
 
+#include <atomic>
 #include <chrono>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <openssl/err.h>
 #include <span>
@@ -428,6 +431,15 @@ namespace ravl
       }
     }
 
+    inline std::chrono::system_clock::time_point to_time_point(
+      const ASN1_TIME* time)
+    {
+      struct tm tm = {};
+      if (time == NULL || ASN1_TIME_to_tm(time, &tm) != 1)
+        throw std::runtime_error("invalid ASN.1 time");
+      return std::chrono::system_clock::from_time_t(timegm(&tm));
+    }
+
     inline std::string to_string_short(const UqX509_CRL& crl, size_t indent = 0)
     {
       std::stringstream ss;
@@ -582,6 +594,184 @@ namespace ravl
       return ctx.final();
     }
 
+    /// Immutable snapshot of trusted root CA certificates and CRLs, shared by
+    /// concurrent verifications.
+    class TrustStore
+    {
+    public:
+      explicit TrustStore(UqX509_STORE&& store_) :
+        version(next_version()),
+        store(std::move(store_))
+      {}
+
+      virtual ~TrustStore() = default;
+
+      /// Unique version number of the snapshot
+      const uint64_t version;
+
+      /// The underlying X509 store (must not be modified, e.g. by adding
+      /// auto-trusted root certificates)
+      UqX509_STORE& get() const
+      {
+        return store;
+      }
+
+    protected:
+      mutable UqX509_STORE store;
+
+      static uint64_t next_version()
+      {
+        static std::atomic<uint64_t> next = 1;
+        return next++;
+      }
+    };
+
+    static constexpr size_t trust_store_cache_max_entries = 64;
+
+    /// Compute a trust store cache key from its contents (e.g. root CA
+    /// certificates and CRLs)
+    inline std::string trust_store_key(
+      std::initializer_list<std::string_view> contents)
+    {
+      UqEVP_MD_CTX ctx(EVP_sha256());
+      for (const auto& c : contents)
+      {
+        uint64_t sz = c.size();
+        ctx.update({(const uint8_t*)&sz, sizeof(sz)});
+        ctx.update({(const uint8_t*)c.data(), c.size()});
+      }
+      return to_hex(ctx.final());
+    }
+
+    /// Get the shared trust store snapshot for a key, or build one with
+    /// `init` if there is none yet.
+    inline std::shared_ptr<const TrustStore> get_trust_store(
+      const std::string& key, const std::function<void(UqX509_STORE&)>& init)
+    {
+      static ExpiringCache<std::string, std::shared_ptr<const TrustStore>>
+        cache(trust_store_cache_max_entries);
+
+      if (auto cached = cache.find(key))
+        return *cached;
+
+      UqX509_STORE store;
+      // These flags also check that we have a CRL for each CA.
+      store.set_flags(X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+      init(store);
+
+      auto r = std::make_shared<const TrustStore>(std::move(store));
+      cache.insert(key, r, std::chrono::system_clock::time_point::max());
+      return r;
+    }
+
+    /// Hit/miss counters of the verified certificate chain cache
+    struct VerifiedChainCacheStatistics
+    {
+      uint64_t hits = 0;
+      uint64_t misses = 0;
+    };
+
+    struct VerifiedChain
+    {
+      UqStackOfX509 chain;
+      std::chrono::system_clock::time_point not_before;
+      std::chrono::system_clock::time_point not_after;
+    };
+
+    class VerifiedChainCache
+      : public ExpiringCache<std::string, std::shared_ptr<const VerifiedChain>>
+    {
+    public:
+      using ExpiringCache::ExpiringCache;
+
+      std::atomic<uint64_t> hits = 0;
+      std::atomic<uint64_t> misses = 0;
+    };
+
+    static constexpr size_t verified_chain_cache_max_entries = 1024;
+
+    // Granularity of verification times in verified chain cache keys; CRLs
+    // that expire within a bucket may be accepted until the end of it.
+    static constexpr auto verified_chain_time_bucket = std::chrono::hours(1);
+
+    inline VerifiedChainCache& verified_chain_cache()
+    {
+      static VerifiedChainCache cache(verified_chain_cache_max_entries);
+      return cache;
+    }
+
+    inline VerifiedChainCacheStatistics verified_chain_cache_statistics()
+    {
+      auto& cache = verified_chain_cache();
+      return {cache.hits.load(), cache.misses.load()};
+    }
+
+    /// Verify a certificate chain against a shared trust store snapshot. The
+    /// result is cached by the hash of the chain, the snapshot version and the
+    /// verification time bucket, so that chains that are the same for all
+    /// attestations (e.g. Intel's TCB info issuer chain) are validated only
+    /// once. Verbose verifications always validate the full chain.
+    inline UqStackOfX509 verify_certificate_chain(
+      const std::string& pem,
+      const TrustStore& trust_store,
+      const CertificateValidationOptions& options,
+      uint8_t verbosity = 0,
+      size_t indent = 0)
+    {
+      using Clock = std::chrono::system_clock;
+
+      if (verbosity > 0)
+        return verify_certificate_chain(
+          pem, trust_store.get(), options, false, verbosity, indent);
+
+      auto t = options.verification_time ?
+        Clock::from_time_t(*options.verification_time) :
+        Clock::now();
+      auto bucket = options.ignore_time ?
+        std::string("-") :
+        std::to_string(t.time_since_epoch() / verified_chain_time_bucket);
+      auto key = fmt::format(
+        "{}:{}:{}",
+        to_hex(sha256({(const uint8_t*)pem.data(), pem.size()})),
+        trust_store.version,
+        bucket);
+
+      auto& cache = verified_chain_cache();
+
+      if (auto cached = cache.find(key))
+      {
+        const auto& vc = **cached;
+        if (options.ignore_time || (vc.not_before <= t && t <= vc.not_after))
+        {
+          cache.hits++;
+          return vc.chain;
+        }
+      }
+
+      cache.misses++;
+
+      auto chain =
+        verify_certificate_chain(pem, trust_store.get(), options, false);
+
+      auto vc = std::make_shared<VerifiedChain>();
+      vc->chain = chain;
+      vc->not_before = Clock::time_point::min();
+      vc->not_after = Clock::time_point::max();
+      for (size_t i = 0; i < chain.size(); i++)
+      {
+        auto c = chain.at(i);
+        vc->not_before =
+          std::max(vc->not_before, to_time_point(X509_get0_notBefore(c)));
+        vc->not_after =
+          std::min(vc->not_after, to_time_point(X509_get0_notAfter(c)));
+      }
+
+      cache.insert(
+        key, vc, options.ignore_time ? Clock::time_point::max() : vc->not_after);
+
+      return chain;
+    }
+
     inline bool verify_certificate(
       UqX509_STORE& store,
       UqX509& certificate,
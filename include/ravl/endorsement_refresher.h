@@ -0,0 +1,304 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "http_client.h"
+#include "util.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define FMT_HEADER_ONLY
+#include <fmt/format.h>
+
+namespace ravl
+{
+  /// Schedule of cached endorsements (e.g. SGX collateral for an FMSPC) that
+  /// can be renewed in the background before they expire.
+  class EndorsementRefreshSchedule
+  {
+  public:
+    using Clock = std::chrono::system_clock;
+
+    /// Minimum time between two renewals of the same endorsements (e.g. when
+    /// the server does not have newer ones yet, or when a download failed)
+    static constexpr auto min_interval = std::chrono::minutes(5);
+
+    struct Task
+    {
+      /// Expiry of the cached endorsements
+      Clock::time_point expiry;
+
+      /// Function that prepares the download requests
+      std::function<HTTPRequests()> prepare;
+
+      /// Function that consumes the responses (and updates the caches)
+      std::function<void(HTTPResponses&&)> consume;
+
+      /// Responses that the cached endorsements were made from (if known);
+      /// used to make the renewal requests conditional
+      std::shared_ptr<const HTTPResponses> responses;
+
+      Clock::time_point last_attempt = Clock::time_point::min();
+      bool in_flight = false;
+    };
+
+    virtual ~EndorsementRefreshSchedule() = default;
+
+    /// Add or update the task for a key (called whenever endorsements are
+    /// cached).
+    void schedule(
+      const std::string& key,
+      Clock::time_point expiry,
+      std::function<HTTPRequests()>&& prepare,
+      std::function<void(HTTPResponses&&)>&& consume,
+      std::shared_ptr<const HTTPResponses> responses = nullptr)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      if (expiry <= Clock::now())
+      {
+        tasks.erase(key);
+        return;
+      }
+
+      auto& task = tasks[key];
+      task.expiry = expiry;
+      task.prepare = std::move(prepare);
+      task.consume = std::move(consume);
+      task.responses = std::move(responses);
+      task.in_flight = false;
+    }
+
+    /// Take the tasks whose endorsements expire within `lead_time` (marking
+    /// them as in flight).
+    std::vector<std::pair<std::string, Task>> take_due(
+      std::chrono::seconds lead_time)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      std::vector<std::pair<std::string, Task>> r;
+      auto now = Clock::now();
+      for (auto& [key, task] : tasks)
+      {
+        if (!task.in_flight && due(task, lead_time) <= now)
+        {
+          task.in_flight = true;
+          task.last_attempt = now;
+          r.emplace_back(key, task);
+        }
+      }
+      return r;
+    }
+
+    /// Earliest time at which a task becomes due.
+    std::optional<Clock::time_point> next_due(
+      std::chrono::seconds lead_time) const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      std::optional<Clock::time_point> r = std::nullopt;
+      for (const auto& [key, task] : tasks)
+        if (!task.in_flight && (!r || due(task, lead_time) < *r))
+          r = due(task, lead_time);
+      return r;
+    }
+
+    /// Finish a task. If the renewed endorsements have not been rescheduled
+    /// (e.g. because the download failed), the task is retried later, unless
+    /// the endorsements have expired already.
+    void finish(const std::string& key)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto it = tasks.find(key);
+      if (it == tasks.end() || !it->second.in_flight)
+        return;
+
+      if (it->second.expiry <= Clock::now())
+        tasks.erase(it);
+      else
+        it->second.in_flight = false;
+    }
+
+    /// Remove all tasks.
+    void clear()
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      tasks.clear();
+    }
+
+    /// Number of tasks
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      return tasks.size();
+    }
+
+  protected:
+    mutable std::mutex mtx;
+    std::map<std::string, Task> tasks;
+
+    static Clock::time_point due(
+      const Task& task, std::chrono::seconds lead_time)
+    {
+      auto t = task.expiry - lead_time;
+      if (task.last_attempt != Clock::time_point::min())
+        t = std::max(t, task.last_attempt + min_interval);
+      return t;
+    }
+  };
+
+  /// Get the process-wide endorsement refresh schedule.
+  inline EndorsementRefreshSchedule& endorsement_refresh_schedule()
+  {
+    static EndorsementRefreshSchedule schedule;
+    return schedule;
+  }
+
+  /// Background thread that renews scheduled endorsements shortly before they
+  /// expire, so that verifications find them in the caches.
+  class EndorsementRefresher
+  {
+  public:
+    using Clock = EndorsementRefreshSchedule::Clock;
+
+    /// Longest time the thread sleeps (newly scheduled tasks are picked up
+    /// after at most this long)
+    static constexpr auto poll_interval = std::chrono::seconds(1);
+
+    /// Constructor (starts the thread)
+    EndorsementRefresher(
+      std::shared_ptr<HTTPClient> http_client_,
+      std::chrono::seconds lead_time_,
+      EndorsementRefreshSchedule& schedule_ = endorsement_refresh_schedule()) :
+      http_client(http_client_),
+      lead_time(lead_time_),
+      schedule(schedule_)
+    {
+      thread = std::thread([this]() { run(); });
+    }
+
+    /// Destructor (stops the thread). Renewals that are still in flight are
+    /// cancelled and left to be retried, e.g. by another refresher.
+    virtual ~EndorsementRefresher()
+    {
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        stop = true;
+      }
+      cv.notify_all();
+      thread.join();
+
+      for (const auto& [id, key] : request_sets)
+      {
+        bool complete = http_client->is_complete(id);
+        http_client->erase(id);
+        if (!complete)
+          schedule.finish(key);
+      }
+    }
+
+    /// Renew all due endorsements now. If the previous responses are known,
+    /// the requests are conditional, and endorsements that have not been
+    /// modified are neither downloaded nor parsed again.
+    void refresh()
+    {
+      std::lock_guard<std::mutex> guard(refresh_mtx);
+
+      auto& schedule_ = schedule;
+      for (auto& [key, task] : schedule.take_due(lead_time))
+      {
+        try
+        {
+          auto requests = task.prepare();
+          auto previous = task.responses;
+          if (previous && previous->size() == requests.size())
+          {
+            for (size_t i = 0; i < requests.size(); i++)
+              make_conditional(requests[i], previous->at(i));
+          }
+          else
+            previous = nullptr;
+
+          auto id = http_client->submit(
+            std::move(requests),
+            [&schedule_, key = key, consume = task.consume, previous](
+              HTTPResponses&& responses) {
+              try
+              {
+                // Unmodified endorsements stay cached as they are.
+                if (!previous || !revalidate(responses, *previous))
+                  consume(std::move(responses));
+              }
+              catch (const std::exception& ex)
+              {
+                log(fmt::format(
+                  "- renewal of endorsements for {} failed: {}",
+                  key,
+                  ex.what()));
+              }
+              schedule_.finish(key);
+            });
+          request_sets.emplace_back(id, key);
+        }
+        catch (const std::exception& ex)
+        {
+          log(fmt::format(
+            "- renewal of endorsements for {} failed: {}", key, ex.what()));
+          schedule.finish(key);
+        }
+      }
+
+      for (auto it = request_sets.begin(); it != request_sets.end();)
+      {
+        if (http_client->is_complete(it->first))
+        {
+          http_client->erase(it->first);
+          it = request_sets.erase(it);
+        }
+        else
+          it++;
+      }
+    }
+
+  protected:
+    std::shared_ptr<HTTPClient> http_client;
+    std::chrono::seconds lead_time;
+    EndorsementRefreshSchedule& schedule;
+    std::mutex refresh_mtx;
+    // Request sets in flight, with the keys of their tasks
+    std::vector<std::pair<HTTPRequestSetId, std::string>> request_sets;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop = false;
+    std::thread thread;
+
+    void run()
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+
+      while (!stop)
+      {
+        lock.unlock();
+        refresh();
+        lock.lock();
+
+        auto wake = Clock::now() + poll_interval;
+        if (auto next = schedule.next_due(lead_time))
+          wake = std::min(wake, *next);
+        cv.wait_until(lock, wake, [this]() { return stop; });
+      }
+    }
+  };
+}
@@ -0,0 +1,65 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "http_client.h"
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace ravl
+{
+  /// Persistent store for downloaded endorsements.
+  ///
+  /// HTTP responses are kept in a memory-mapped, append-only file, indexed by
+  /// request URL (which identifies the FMSPC, chip ID, etc) and by expiry
+  /// time. Later records supersede earlier ones; expired and superseded
+  /// records are dropped when the file is compacted. Multiple processes may
+  /// share a store file (appends are serialized via flock(2)). In WebAssembly
+  /// builds, the store keeps nothing.
+  class EndorsementStore
+  {
+  public:
+    using Clock = std::chrono::system_clock;
+
+    /// Constructor (creates the file if it does not exist)
+    EndorsementStore(const std::string& path);
+
+    /// Destructor
+    virtual ~EndorsementStore();
+
+    /// Find an unexpired response for a URL.
+    std::optional<HTTPResponse> find(const std::string& url);
+
+    /// Find unexpired responses for all requests in a set (or none).
+    std::optional<HTTPResponses> find(const HTTPRequests& requests);
+
+    /// Append a response for a URL (unless the same response is stored
+    /// already).
+    void insert(
+      const std::string& url,
+      const HTTPResponse& response,
+      Clock::time_point expiry);
+
+    /// Append responses for all requests in a set.
+    void insert(
+      const HTTPRequests& requests,
+      const HTTPResponses& responses,
+      Clock::time_point expiry);
+
+    /// Rewrite the file, keeping only unexpired, current records.
+    void compact();
+
+    /// Number of unexpired records.
+    size_t size() const;
+
+    /// Get the process-wide store for a path.
+    static std::shared_ptr<EndorsementStore> get(const std::string& path);
+
+  private:
+    void* implementation;
+  };
+}
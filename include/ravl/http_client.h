@@ -5,25 +5,151 @@
 
 #include "util.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <initializer_list>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace ravl
 {
   typedef size_t HTTPRequestSetId;
 
+  /// HTTP header names are case-insensitive (ASCII)
+  inline bool header_name_equal(std::string_view a, std::string_view b)
+  {
+    auto lower = [](unsigned char c) {
+      return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    };
+    return std::equal(
+      a.begin(), a.end(), b.begin(), b.end(), [&lower](char x, char y) {
+        return lower(x) == lower(y);
+      });
+  }
+
+  /// Response headers, stored in a flat list with case-insensitive lookup.
+  /// Responses carry few headers, so a linear scan over contiguous entries is
+  /// cheaper than hashing (and allocating) every name.
+  class HTTPHeaders
+  {
+  public:
+    typedef std::pair<std::string, std::string> value_type;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    /// Number of entries for which space is reserved on the first insertion
+    static constexpr size_t initial_capacity = 16;
+
+    HTTPHeaders() = default;
+    HTTPHeaders(std::initializer_list<value_type> entries_) : entries(entries_)
+    {}
+
+    /// Find the value of a header, or nullptr
+    const std::string* find(std::string_view name) const
+    {
+      for (const auto& [k, v] : entries)
+        if (header_name_equal(k, name))
+          return &v;
+      return nullptr;
+    }
+
+    bool contains(std::string_view name) const
+    {
+      return find(name) != nullptr;
+    }
+
+    /// Add a header, unless one of the same name exists already
+    bool emplace(std::string_view name, std::string_view value)
+    {
+      if (contains(name))
+        return false;
+      append(name, value);
+      return true;
+    }
+
+    /// Get the value of a header, adding an empty one if it does not exist
+    std::string& operator[](std::string_view name)
+    {
+      for (auto& [k, v] : entries)
+        if (header_name_equal(k, name))
+          return v;
+      return append(name, {});
+    }
+
+    size_t size() const
+    {
+      return entries.size();
+    }
+
+    bool empty() const
+    {
+      return entries.empty();
+    }
+
+    void clear()
+    {
+      entries.clear();
+    }
+
+    const_iterator begin() const
+    {
+      return entries.begin();
+    }
+
+    const_iterator end() const
+    {
+      return entries.end();
+    }
+
+  protected:
+    std::vector<value_type> entries;
+
+    std::string& append(std::string_view name, std::string_view value)
+    {
+      if (entries.capacity() == 0)
+        entries.reserve(initial_capacity);
+      return entries.emplace_back(name, value).second;
+    }
+  };
+
+  /// Split a raw response header line ("Name: value\r\n") into its name and
+  /// its value (without surrounding whitespace); nullopt if the line is not a
+  /// header (e.g. the status line or the empty line after the headers).
+  inline std::optional<std::pair<std::string_view, std::string_view>>
+  parse_header_line(std::string_view line)
+  {
+    auto colon = line.find(':');
+    if (colon == std::string_view::npos || colon == 0)
+      return std::nullopt;
+
+    auto name = line.substr(0, colon);
+    if (name.find_first_of(" \t") != std::string_view::npos)
+      return std::nullopt;
+
+    auto value = line.substr(colon + 1);
+    auto begin = value.find_first_not_of(" \t");
+    auto end = value.find_last_not_of(" \t\r\n");
+    if (begin == std::string_view::npos || end < begin)
+      value = {};
+    else
+      value = value.substr(begin, end - begin + 1);
+    return std::make_pair(name, value);
+  }
+
   struct HTTPResponse
   {
     uint32_t status = 0;
-    std::unordered_map<std::string, std::string> headers = {};
+    HTTPHeaders headers = {};
     std::string body = "";
 
     std::vector<uint8_t> get_header_data(
@@ -31,6 +157,9 @@ namespace ravl
 
     std::string get_header_string(
       const std::string& name, bool url_decoded = false) const;
+
+    /// Find a header (case-insensitive)
+    const std::string* find_header(std::string_view name) const;
   };
 
   struct HTTPRequest
@@ -42,21 +171,57 @@ namespace ravl
     std::string url = "";
     std::unordered_map<std::string, std::string> headers = {};
     std::string body = "";
+
+    /// URLs of mirrors that serve the same resource; the client sends the
+    /// request to the fastest of them (and the URL), and fails over to, or
+    /// hedges with, the others.
+    std::vector<std::string> mirrors = {};
   };
 
   typedef std::vector<HTTPRequest> HTTPRequests;
   typedef std::vector<HTTPResponse> HTTPResponses;
 
+  /// Statistics of the bodies of all HTTP responses received
+  struct HTTPTransferStatistics
+  {
+    /// Number of responses
+    uint64_t responses = 0;
+
+    /// Number of body bytes received (compressed, if compression is enabled)
+    uint64_t wire_bytes = 0;
+
+    /// Number of body bytes after decompression
+    uint64_t body_bytes = 0;
+
+    /// Number of bytes saved by compression
+    uint64_t saved_bytes() const
+    {
+      return body_bytes > wire_bytes ? body_bytes - wire_bytes : 0;
+    }
+  };
+
+  /// Get the transfer statistics of all HTTP clients in the process
+  HTTPTransferStatistics http_transfer_statistics();
+
   class HTTPClient
   {
   public:
+    /// Default time (in seconds) after which idle connections are closed
+    static constexpr size_t default_connection_idle_timeout = 118;
+
     HTTPClient(
       size_t request_timeout_ = 0,
       size_t max_attempts_ = 5,
-      bool verbose_ = false) :
+      bool verbose_ = false,
+      size_t connection_idle_timeout_ = default_connection_idle_timeout,
+      bool http2_ = true,
+      bool compression_ = false) :
       request_timeout(request_timeout_),
       max_attempts(max_attempts_),
-      verbose(verbose_)
+      verbose(verbose_),
+      connection_idle_timeout(connection_idle_timeout_),
+      http2(http2_),
+      compression(compression_)
     {}
     virtual ~HTTPClient() = default;
 
@@ -71,6 +236,14 @@ namespace ravl
     size_t request_timeout = 0;
     size_t max_attempts = 5;
     bool verbose = false;
+    size_t connection_idle_timeout = default_connection_idle_timeout;
+
+    /// Negotiate HTTP/2 where available (and multiplex requests to the same
+    /// host over one connection)
+    bool http2 = true;
+
+    /// Ask for compressed responses (which are decompressed transparently)
+    bool compression = false;
   };
 
   class SynchronousHTTPClient : public HTTPClient
@@ -79,7 +252,10 @@ namespace ravl
     SynchronousHTTPClient(
       size_t request_timeout_ = 0,
       size_t max_attempts_ = 5,
-      bool verbose_ = false);
+      bool verbose_ = false,
+      size_t connection_idle_timeout_ = default_connection_idle_timeout,
+      bool http2_ = true,
+      bool compression_ = false);
     virtual ~SynchronousHTTPClient() = default;
 
     virtual HTTPRequestSetId submit(
@@ -92,7 +268,21 @@ namespace ravl
       const HTTPRequest& request,
       size_t timeout = 0,
       size_t max_attempts = 5,
-      bool verbose_ = false);
+      bool verbose_ = false,
+      size_t connection_idle_timeout_ = default_connection_idle_timeout,
+      bool http2_ = true,
+      bool compression_ = false);
+
+    /// Execute a set of requests concurrently; the responses are in the order
+    /// of the requests.
+    static HTTPResponses execute_synchronous(
+      const HTTPRequests& requests,
+      size_t timeout = 0,
+      size_t max_attempts = 5,
+      bool verbose_ = false,
+      size_t connection_idle_timeout_ = default_connection_idle_timeout,
+      bool http2_ = true,
+      bool compression_ = false);
 
     virtual void erase(const HTTPRequestSetId& id) override;
 
@@ -101,13 +291,64 @@ namespace ravl
     std::unordered_map<HTTPRequestSetId, HTTPResponses> response_sets;
   };
 
+  /// Limits on the requests that an HTTP client sends to a single host
+  struct HTTPHostLimits
+  {
+    /// Sustained request rate (requests per second; 0 = unlimited)
+    double requests_per_second = 0;
+
+    /// Number of requests that may be sent in a burst
+    size_t burst = 10;
+
+    /// Maximum number of concurrent connections and requests in flight
+    /// (0 = unlimited)
+    size_t max_connections = 0;
+
+    /// Maximum number of requests waiting to be sent (0 = unlimited); further
+    /// requests fail immediately
+    size_t max_queue_depth = 0;
+  };
+
+  /// Per-host statistics of an HTTP client
+  struct HTTPHostStatistics
+  {
+    /// Number of requests waiting to be sent
+    size_t queue_depth = 0;
+
+    /// Number of requests in flight
+    size_t active = 0;
+
+    /// Number of requests sent (including retries)
+    uint64_t requests = 0;
+
+    /// Number of requests rejected because the queue was full
+    uint64_t rejected = 0;
+
+    /// Number of HTTP 429 (Too Many Requests) responses
+    uint64_t throttled = 0;
+
+    /// Total time for which requests to the host were paused after HTTP 429
+    /// responses
+    std::chrono::milliseconds throttled_time = {};
+
+    /// Rolling average of the response time (0 if unknown)
+    std::chrono::microseconds latency_ewma = {};
+
+    /// 95th percentile of recent response times (0 if unknown)
+    std::chrono::microseconds latency_p95 = {};
+  };
+
   class AsynchronousHTTPClient : public HTTPClient
   {
   public:
     AsynchronousHTTPClient(
       size_t request_timeout_ = 0,
       size_t max_attempts_ = 5,
-      bool verbose_ = false);
+      bool verbose_ = false,
+      size_t connection_idle_timeout_ = default_connection_idle_timeout,
+      bool http2_ = true,
+      bool compression_ = false,
+      const HTTPHostLimits& host_limits_ = {});
     virtual ~AsynchronousHTTPClient();
 
     virtual HTTPRequestSetId submit(
@@ -118,6 +359,10 @@ namespace ravl
 
     virtual void erase(const HTTPRequestSetId& id) override;
 
+    /// Get the statistics of all hosts (by "host:port")
+    std::unordered_map<std::string, HTTPHostStatistics> host_statistics()
+      const;
+
   private:
     void* implementation;
   };
@@ -133,22 +378,22 @@ namespace ravl
     return r;
   }
 
+  inline const std::string* HTTPResponse::find_header(
+    std::string_view name) const
+  {
+    return headers.find(name);
+  }
+
   inline std::vector<uint8_t> HTTPResponse::get_header_data(
     const std::string& name, bool url_decoded) const
   {
-    auto hit = headers.find(name);
-    if (hit == headers.end())
-    {
-      std::string lname = name;
-      std::transform(lname.begin(), lname.end(), lname.begin(), ::tolower);
-      hit = headers.find(lname);
-      if (hit == headers.end())
-        throw std::runtime_error("missing response header '" + name + "'");
-    }
+    auto value = find_header(name);
+    if (!value)
+      throw std::runtime_error("missing response header '" + name + "'");
     if (url_decoded)
-      return url_decode(hit->second);
+      return url_decode(*value);
     else
-      return {hit->second.data(), hit->second.data() + hit->second.size()};
+      return {value->data(), value->data() + value->size()};
   }
 
   inline std::string HTTPResponse::get_header_string(
@@ -157,4 +402,50 @@ namespace ravl
     auto t = get_header_data(name, url_decoded);
     return std::string(t.begin(), t.end());
   }
+
+  /// Make a request conditional on the resource having changed since
+  /// `previous` was received, via the validators (ETag, Last-Modified) of
+  /// `previous`. Returns false if `previous` has no validators.
+  inline bool make_conditional(
+    HTTPRequest& request, const HTTPResponse& previous)
+  {
+    bool r = false;
+    if (auto etag = previous.find_header("ETag"))
+    {
+      request.headers["If-None-Match"] = *etag;
+      r = true;
+    }
+    if (auto last_modified = previous.find_header("Last-Modified"))
+    {
+      request.headers["If-Modified-Since"] = *last_modified;
+      r = true;
+    }
+    return r;
+  }
+
+  /// Whether a request is conditional (and may be answered with 304)
+  inline bool is_conditional(const HTTPRequest& request)
+  {
+    return request.headers.contains("If-None-Match") ||
+      request.headers.contains("If-Modified-Since");
+  }
+
+  /// Replace responses with status 304 (Not Modified) to conditional requests
+  /// by the corresponding previous responses. Returns true if none of the
+  /// resources have been modified.
+  inline bool revalidate(HTTPResponses& responses, const HTTPResponses& previous)
+  {
+    if (responses.size() != previous.size())
+      return false;
+
+    bool r = true;
+    for (size_t i = 0; i < responses.size(); i++)
+    {
+      if (responses[i].status == 304)
+        responses[i] = previous[i];
+      else
+        r = false;
+    }
+    return r;
+  }
 }
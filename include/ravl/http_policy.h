@@ -0,0 +1,229 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Policies of the HTTP clients that do not depend on the transport.
+
+namespace ravl
+{
+  // Retry policy: HTTP 429 and 5xx responses and transient transport errors
+  // are retried after the delay requested by the server (Retry-After), or
+  // otherwise after an exponentially growing, jittered delay.
+  inline constexpr auto retry_base_delay = std::chrono::milliseconds(500);
+  inline constexpr auto retry_max_delay = std::chrono::seconds(30);
+
+  /// Delay before attempt number `attempt + 1` (attempts are counted from 1):
+  /// retry_base_delay, doubled for each further attempt up to
+  /// retry_max_delay, and jittered to between half of that and all of it.
+  inline std::chrono::milliseconds retry_backoff_delay(size_t attempt)
+  {
+    thread_local std::mt19937_64 rng(std::random_device{}());
+
+    auto d = std::chrono::milliseconds(retry_max_delay);
+    attempt = std::max<size_t>(attempt, 1);
+    if (attempt < 16)
+      d = std::min(d, retry_base_delay * (1 << (attempt - 1)));
+
+    // Random delay in [d/2, d], so that clients do not retry in lock-step.
+    std::uniform_int_distribution<int64_t> dist(d.count() / 2, d.count());
+    return std::chrono::milliseconds(dist(rng));
+  }
+
+  /// Parse the value of a Retry-After header; only delays in seconds are
+  /// supported (not HTTP dates).
+  inline std::optional<std::chrono::seconds> parse_retry_after(
+    std::string_view value)
+  {
+    while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+      value.remove_prefix(1);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+      value.remove_suffix(1);
+
+    uint64_t seconds = 0;
+    auto end = value.data() + value.size();
+    auto [ptr, ec] = std::from_chars(value.data(), end, seconds);
+    if (value.empty() || ec != std::errc() || ptr != end)
+      return std::nullopt;
+    return std::chrono::seconds(
+      std::min<uint64_t>(seconds, std::chrono::seconds::max().count()));
+  }
+
+  /// Delay requested by a server, capped at retry_max_delay and at the
+  /// request timeout (in seconds, 0 = none), so that a server cannot stall
+  /// its clients indefinitely
+  inline std::chrono::milliseconds cap_retry_after(
+    std::chrono::seconds retry_after, size_t timeout)
+  {
+    auto max_delay = std::chrono::seconds(retry_max_delay);
+    if (timeout > 0)
+      max_delay = std::min<std::chrono::seconds>(
+        max_delay, std::chrono::seconds(timeout));
+    return std::min(retry_after, max_delay);
+  }
+
+  /// Token bucket limiting the rate of requests to a host: it holds up to
+  /// `burst` tokens, is refilled at `rate` tokens per second, and each request
+  /// takes one token (a rate of 0 means no limit).
+  class TokenBucket
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(
+      double rate_ = 0,
+      size_t burst_ = 0,
+      Clock::time_point now = Clock::now()) :
+      rate(rate_),
+      burst(burst_),
+      tokens(burst_),
+      last_refill(now)
+    {}
+
+    /// Take a token if one is available at `now`
+    bool try_take(Clock::time_point now)
+    {
+      if (rate <= 0)
+        return true;
+
+      refill(now);
+      if (tokens < 1)
+        return false;
+      tokens -= 1;
+      return true;
+    }
+
+    /// Time at which the next token is available
+    Clock::time_point available_at() const
+    {
+      if (rate <= 0 || tokens >= 1)
+        return last_refill;
+      return last_refill +
+        std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>((1 - tokens) / rate));
+    }
+
+  protected:
+    double rate = 0;
+    size_t burst = 0;
+    double tokens = 0;
+    Clock::time_point last_refill;
+
+    void refill(Clock::time_point now)
+    {
+      if (now <= last_refill)
+        return;
+      std::chrono::duration<double> elapsed = now - last_refill;
+      tokens = std::min<double>(burst, tokens + elapsed.count() * rate);
+      last_refill = now;
+    }
+  };
+
+  /// Rolling latency estimates of hosts (an EWMA and the 95th percentile of
+  /// recent samples), used to pick the fastest of a set of mirrors and to
+  /// decide when to send a hedged request to another one.
+  class LatencyTracker
+  {
+  public:
+    using Duration = std::chrono::microseconds;
+
+    static constexpr double alpha = 0.2;
+    static constexpr size_t window = 64;
+    static constexpr size_t min_samples = 5;
+
+    void record(const std::string& host, Duration latency)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto& h = hosts[host];
+      double us = latency.count();
+      h.ewma = h.samples.empty() ? us : alpha * us + (1 - alpha) * h.ewma;
+      if (h.samples.size() < window)
+        h.samples.push_back(latency);
+      else
+        h.samples[h.next_sample++ % window] = latency;
+      h.failures = 0;
+    }
+
+    void record_failure(const std::string& host)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      hosts[host].failures++;
+    }
+
+    std::optional<Duration> ewma(const std::string& host) const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto hit = hosts.find(host);
+      if (hit == hosts.end() || hit->second.samples.empty())
+        return std::nullopt;
+      return Duration(static_cast<int64_t>(hit->second.ewma));
+    }
+
+    std::optional<Duration> p95(const std::string& host) const
+    {
+      std::vector<Duration> samples;
+
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        auto hit = hosts.find(host);
+        if (hit == hosts.end() || hit->second.samples.size() < min_samples)
+          return std::nullopt;
+        samples = hit->second.samples;
+      }
+
+      auto nth = samples.begin() + (samples.size() * 95 + 99) / 100 - 1;
+      std::nth_element(samples.begin(), nth, samples.end());
+      return *nth;
+    }
+
+    /// Order URLs by the estimated latency of their hosts, as determined by
+    /// `host_of` (hosts that failed most recently last; the order of hosts
+    /// without estimates is kept).
+    template <typename HostOf>
+    std::vector<std::string> order(
+      std::vector<std::string> urls, HostOf host_of) const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto rank = [this, &host_of](const std::string& url) {
+        auto hit = hosts.find(host_of(url));
+        if (hit == hosts.end())
+          return std::make_pair(false, 0.0);
+        return std::make_pair(hit->second.failures > 0, hit->second.ewma);
+      };
+
+      std::stable_sort(
+        urls.begin(), urls.end(), [&rank](const auto& a, const auto& b) {
+          return rank(a) < rank(b);
+        });
+      return urls;
+    }
+
+  protected:
+    struct Host
+    {
+      double ewma = 0;
+      std::vector<Duration> samples;
+      size_t next_sample = 0;
+      size_t failures = 0;
+    };
+
+    mutable std::mutex mtx;
+    std::unordered_map<std::string, Host> hosts;
+  };
+}
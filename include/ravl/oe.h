@@ -28,6 +28,8 @@ namespace ravl
       std::map<std::string, std::vector<uint8_t>> custom_claims;
 
       virtual std::string to_json() const override;
+
+      virtual std::shared_ptr<ravl::Claims> clone() const override;
     };
 
     class Attestation : public ravl::Attestation
@@ -48,6 +50,8 @@ namespace ravl
         const Options& options = {},
         const std::optional<HTTPResponses>& http_responses = {}) const override;
 
+      virtual std::string platform_id() const override;
+
       void compress_pck_certificate_chain(bool resize_evidence = true);
 
     protected:
@@ -157,6 +157,14 @@ namespace ravl
       return ravl::json(*this).dump();
     }
 
+    RAVL_VISIBILITY std::shared_ptr<ravl::Claims> Claims::clone() const
+    {
+      auto r = std::make_shared<Claims>(*this);
+      if (sgx_claims)
+        r->sgx_claims = std::make_shared<sgx::Claims>(*sgx_claims);
+      return r;
+    }
+
 #ifndef RAVL_USE_OE_VERIFIER
     RAVL_VISIBILITY std::
       pair<std::shared_ptr<sgx::Attestation>, std::vector<uint8_t>>
@@ -460,6 +468,17 @@ namespace ravl
       }
     }
 
+    RAVL_VISIBILITY std::string Attestation::platform_id() const
+    {
+#ifdef RAVL_USE_OE_VERIFIER
+      return "openenclave";
+#else
+      if (sgx_attestation)
+        return sgx_attestation->platform_id();
+      return extract_sgx_attestation(*this).first->platform_id();
+#endif
+    }
+
     RAVL_VISIBILITY std::optional<HTTPRequests> Attestation::
       prepare_endorsements(const Options& options) const
     {
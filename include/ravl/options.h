@@ -8,6 +8,7 @@
 #include <cstdint>
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace ravl
 {
@@ -37,16 +38,33 @@ namespace ravl
     std::optional<std::string> sgx_endorsement_cache_url_template =
       std::nullopt;
 
+    /// URL templates of mirrors of the SGX endorsement cache (used only if
+    /// sgx_endorsement_cache_url_template is set)
+    std::vector<std::string> sgx_endorsement_cache_url_mirrors = {};
+
     /// Optional URL template for cached AMD SEV/SNP endorsements
     std::optional<std::string> sev_snp_endorsement_cache_url_template =
       std::nullopt;
 
+    /// URL templates of mirrors of the AMD SEV/SNP endorsement cache (used
+    /// only if sev_snp_endorsement_cache_url_template is set)
+    std::vector<std::string> sev_snp_endorsement_cache_url_mirrors = {};
+
     /// Timeout for HTTP requests (in seconds; 0 = no limit)
     size_t http_timeout = 90;
 
     /// Maximum number of attempts for HTTP requests
     size_t http_max_attempts = 5;
 
+    /// Time after which idle HTTP connections are closed (in seconds)
+    size_t http_connection_idle_timeout = 118;
+
+    /// Use HTTP/2 where available (otherwise HTTP/1.1)
+    bool http2 = true;
+
+    /// Ask for compressed HTTP responses (e.g. gzip, br)
+    bool http_compression = false;
+
     /// Accept historical attestations where SVNs may be smaller than for fresh
     /// attestations
     bool historical = false;
@@ -54,5 +72,21 @@ namespace ravl
     /// Partial verification: only critical fields in the attestation (e.g. when
     /// TCB info and others have been verified previously)
     bool partial = false;
+
+    /// Keep downloaded endorsements in an in-process cache and reuse them
+    /// until they expire
+    bool cache_endorsements = true;
+
+    /// Optional path of a file in which downloaded endorsements are kept
+    /// across process restarts (requires cache_endorsements)
+    std::optional<std::string> endorsement_store_path = std::nullopt;
+
+    /// Keep verification results (claims) in an in-process cache, keyed by a
+    /// digest of the attestation and of these options, and reuse them until
+    /// they expire or newer endorsements for the platform are loaded
+    bool cache_verdicts = false;
+
+    /// Lifetime of cached verification results (in seconds)
+    size_t verdict_cache_ttl = 300;
   };
 }
@@ -14,7 +14,6 @@
 namespace ravl
 {
   /// Synchronized verification (awaited async).
-  /// Note: this uses std::this_thread::sleep_for.
   std::shared_ptr<Claims> verify_synchronized(
     std::shared_ptr<const Attestation> attestation,
     const Options& options = Options(),
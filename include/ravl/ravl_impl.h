@@ -7,10 +7,9 @@
 #include "http_client.h"
 #include "ravl.h"
 #include "request_tracker_impl.h"
+#include "verdict_cache.h"
 #include "visibility.h"
 
-#include <thread>
-
 namespace ravl
 {
   RAVL_VISIBILITY std::shared_ptr<Claims> verify_synchronized(
@@ -23,23 +22,9 @@ namespace ravl
 
     auto request_tracker = std::make_shared<AttestationRequestTracker>();
 
-    auto id = request_tracker->submit(
-      options,
-      attestation,
-      http_client,
-      [request_tracker](AttestationRequestTracker::RequestID id_) {
-        request_tracker->advance(id_);
-      });
-
-    auto state = request_tracker->state(id);
-    while (state != AttestationRequestTracker::FINISHED &&
-           state != AttestationRequestTracker::ERROR)
-    {
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-      state = request_tracker->state(id);
-    }
+    auto id = request_tracker->submit(options, attestation, http_client);
 
-    if (state == AttestationRequestTracker::ERROR)
+    if (request_tracker->wait(id) == AttestationRequestTracker::ERROR)
       throw std::runtime_error("error");
 
     auto r = request_tracker->result(id);
@@ -50,8 +35,17 @@ namespace ravl
   RAVL_VISIBILITY std::shared_ptr<Claims> verify_synchronous(
     std::shared_ptr<const Attestation> attestation, const Options& options)
   {
+    std::optional<VerdictCacheTicket> verdict_ticket;
+    if (auto claims = find_verdict(*attestation, options, verdict_ticket))
+      return claims;
+
     auto http_client = std::make_shared<SynchronousHTTPClient>(
-      options.http_timeout, options.http_max_attempts, options.verbosity > 0);
+      options.http_timeout,
+      options.http_max_attempts,
+      options.verbosity > 0,
+      options.http_connection_idle_timeout,
+      options.http2,
+      options.http_compression);
     auto requests = attestation->prepare_endorsements(options);
     std::optional<HTTPResponses> http_responses = std::nullopt;
     if (requests)
@@ -59,6 +53,9 @@ namespace ravl
         std::move(*requests), [&http_responses](HTTPResponses&& r) {
           http_responses = std::move(r);
         });
-    return attestation->verify(options, http_responses);
+    auto claims = attestation->verify(options, http_responses);
+    if (verdict_ticket)
+      cache_verdict(*verdict_ticket, options, claims);
+    return claims;
   }
 }
@@ -5,10 +5,16 @@
 
 #include "attestation.h"
 #include "options.h"
+#include "worker_pool.h"
 
+#include <chrono>
+#include <future>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <span>
+#include <string>
+#include <vector>
 
 namespace ravl
 {
@@ -16,8 +22,11 @@ namespace ravl
   class AttestationRequestTracker
   {
   public:
-    /// Constructor
-    AttestationRequestTracker();
+    /// Constructor; verification of requests whose endorsements arrive
+    /// asynchronously runs on a pool of `verification_pool.threads` workers
+    /// (or, by default, on the thread that delivers the endorsements, e.g. an
+    /// HTTP client's).
+    AttestationRequestTracker(const WorkerPoolOptions& verification_pool = {});
 
     /// Destructor
     virtual ~AttestationRequestTracker();
@@ -58,9 +67,88 @@ namespace ravl
     /// Get the result of an async verification request.
     std::shared_ptr<Claims> result(RequestID id) const;
 
+    /// Wait for an async verification request to complete (successfully or
+    /// not) and return its final state. Requests that are unknown or erased
+    /// while waiting are in the ERROR state.
+    RequestState wait(RequestID id) const;
+
+    /// Wait for at most `timeout` for an async verification request to
+    /// complete and return its state (which is not final on timeout).
+    RequestState wait_for(
+      RequestID id, std::chrono::milliseconds timeout) const;
+
+    /// Get a future for the result of an async verification request; failed
+    /// requests set an exception instead.
+    std::future<std::shared_ptr<Claims>> get_future(RequestID id);
+
+    /// Call `continuation` with the final state of an async verification
+    /// request when it completes (on the thread that completes it). Returns
+    /// false, without calling it, if the request has completed already or
+    /// does not exist.
+    bool when_complete(
+      RequestID id, std::function<void(RequestState)>&& continuation);
+
+    /// Statistics of a batch verification
+    struct BatchStatistics
+    {
+      /// Number of attestations
+      size_t attestations = 0;
+
+      /// Number of distinct sets of endorsements (each downloaded once)
+      size_t endorsement_sets = 0;
+
+      /// Number of attestations with cached verification results
+      size_t cached_verdicts = 0;
+
+      /// Time spent grouping attestations by their endorsements
+      std::chrono::microseconds preparation_time = {};
+
+      /// Time spent downloading endorsements
+      std::chrono::microseconds download_time = {};
+
+      /// Time spent verifying attestations (in parallel)
+      std::chrono::microseconds verification_time = {};
+
+      /// Total time
+      std::chrono::microseconds total_time = {};
+    };
+
+    /// Results of a batch verification
+    struct BatchResult
+    {
+      /// Claims, in the order of the attestations (nullptr for failed
+      /// verifications)
+      std::vector<std::shared_ptr<Claims>> claims;
+
+      /// Errors, in the order of the attestations (empty for successful
+      /// verifications)
+      std::vector<std::string> errors;
+
+      /// Statistics
+      BatchStatistics statistics;
+    };
+
+    /// Verify a batch of attestations. Attestations that need the same
+    /// endorsements share one download of them, all endorsements are
+    /// downloaded concurrently as one request set (if that fails, the sets
+    /// are retried separately so that a failure fails only the attestations
+    /// that need it), and the attestations are verified in parallel (on the
+    /// verification pool, or on a temporary one if the tracker has none or
+    /// this is called from one of its workers).
+    BatchResult verify_batch(
+      std::span<const std::shared_ptr<const Attestation>> attestations,
+      const Options& options = {},
+      std::shared_ptr<HTTPClient> http_client = nullptr);
+
     /// Erase an async verification request (including its result).
     void erase(RequestID id);
 
+    /// Renew cached endorsements in the background, lead_time seconds before
+    /// they expire, until the tracker is destroyed.
+    void refresh_endorsements(
+      std::shared_ptr<HTTPClient> http_client = nullptr,
+      size_t lead_time = 3600);
+
   private:
     void* implementation;
   };
@@ -3,12 +3,25 @@
 
 #pragma once
 
+#include "endorsement_refresher.h"
 #include "http_client.h"
 #include "request_tracker.h"
+#include "slot_map.h"
+#include "verdict_cache.h"
 #include "visibility.h"
+#include "worker_pool.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <iterator>
+#include <map>
 #include <mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
 
 #define FMT_HEADER_ONLY
 #include <fmt/format.h>
@@ -40,68 +53,88 @@ namespace ravl
       {}
 
       Request(const Request& other) = delete;
-      AttestationRequestTracker::RequestState state = RequestState::ERROR;
+      std::atomic<AttestationRequestTracker::RequestState> state =
+        RequestState::ERROR;
       Options options;
       std::shared_ptr<const Attestation> attestation;
       std::shared_ptr<Claims> claims;
       std::shared_ptr<HTTPClient> http_client;
       std::function<void(RequestID)> callback;
       std::optional<HTTPRequestSetId> http_request_set_id;
+      HTTPResponses http_responses;
+      std::optional<VerdictCacheTicket> verdict_ticket;
+
+      // Completion: waiters are notified and continuations are run when the
+      // request reaches a final state (or is erased).
+      std::mutex completion_mtx;
+      std::condition_variable completion_cv;
+      std::vector<std::function<void(const Request&)>> continuations;
+      bool erased = false;
     };
 
-    using Requests = std::map<AttestationRequestTracker::RequestID, Request>;
-    using HTTPResponseMap =
-      std::map<AttestationRequestTracker::RequestID, HTTPResponses>;
+    // Requests are kept in a sharded slot map, so that concurrent
+    // verifications don't contend on a single lock; request IDs are the
+    // (generation-tagged) keys of the map.
+    using Requests = ShardedSlotMap<Request>;
+    static_assert(sizeof(RequestID) >= sizeof(Requests::Key));
 
-    mutable std::mutex requests_mtx;
     Requests requests;
-    std::shared_ptr<HTTPClient> http_client;
-    std::atomic<AttestationRequestTracker::RequestID> next_request_id = 0;
-    mutable std::mutex responses_mtx;
-    HTTPResponseMap http_responses;
 
-    RequestID submit(
-      const Options& options,
-      std::shared_ptr<const Attestation> attestation,
-      std::shared_ptr<HTTPClient> http_client_,
-      std::function<void(RequestID)>&& callback)
+    // Endorsement downloads in flight, by HTTP client and request (see
+    // download_key), with the requests (and the indices of their HTTP
+    // requests) waiting for them.
+    struct PendingDownloads
     {
-      RequestID request_id;
-      Requests::iterator rit;
+      std::vector<std::string> keys;
+      HTTPResponses responses;
+      size_t outstanding = 0;
 
-      {
-        std::lock_guard<std::mutex> guard(responses_mtx);
+      // Keys of the downloads in the request's own HTTP request set
+      std::vector<std::string> submitted;
+    };
 
-        request_id = next_request_id++;
+    std::mutex downloads_mtx;
+    std::unordered_map<std::string, std::vector<std::pair<RequestID, size_t>>>
+      downloads;
+    std::map<RequestID, PendingDownloads> pending_downloads;
 
-        auto [it, ok] = requests.try_emplace(
-          request_id,
-          RequestState::SUBMITTED,
-          options,
-          attestation,
-          http_client_,
-          std::move(callback));
+    std::mutex refresher_mtx;
+    std::unique_ptr<EndorsementRefresher> refresher;
 
-        if (!ok)
-          throw std::bad_alloc();
+    // Workers that verify requests once their endorsements have arrived, so
+    // that verification doesn't block the HTTP client's threads. Declared
+    // last, so that the workers are joined before anything else is destroyed.
+    WorkerPool verification_pool;
 
-        rit = it;
-      }
+    AttestationRequestTrackerImpl(const WorkerPoolOptions& pool_options) :
+      verification_pool(pool_options)
+    {}
 
-      advance(request_id, rit->second);
+    RequestID submit(
+      const Options& options,
+      std::shared_ptr<const Attestation> attestation,
+      std::shared_ptr<HTTPClient> http_client_,
+      std::function<void(RequestID)>&& callback)
+    {
+      RequestID request_id = requests.emplace(
+        RequestState::SUBMITTED,
+        options,
+        attestation,
+        http_client_,
+        std::move(callback));
+
+      advance(request_id, *requests.find(request_id));
 
       return request_id;
     }
 
     RequestState state(RequestID id) const
     {
-      std::lock_guard<std::mutex> guard(requests_mtx);
-
-      auto rit = requests.find(id);
-      if (rit == requests.end())
+      auto request = requests.find(id);
+      if (!request)
         return RequestState::ERROR;
       else
-        return rit->second.state;
+        return request->state;
     }
 
     RequestID advance(RequestID id, Request& req)
@@ -113,6 +146,13 @@ namespace ravl
           case RequestState::ERROR:
             throw std::runtime_error("verification request failed");
           case RequestState::SUBMITTED:
+            if (find_verdict(req))
+            {
+              complete(req, RequestState::FINISHED);
+              if (req.callback)
+                req.callback(id);
+              break;
+            }
             req.state = RequestState::WAITING_FOR_ENDORSEMENTS;
             if (!prepare_endorsements(id, req))
             {
@@ -125,7 +165,7 @@ namespace ravl
             break;
           case RequestState::HAVE_ENDORSEMENTS:
             verify(id, req);
-            req.state = RequestState::FINISHED;
+            complete(req, RequestState::FINISHED);
             if (req.callback)
               req.callback(id);
             break;
@@ -138,12 +178,107 @@ namespace ravl
       catch (std::exception& ex)
       {
         log(fmt::format("- exception: {}", ex.what()), 2);
-        req.state = RequestState::ERROR;
+        complete(req, RequestState::ERROR);
       }
 
       return req.state;
     }
 
+    // Move a request into a final state, notify waiters, and run its
+    // continuations.
+    void complete(Request& req, RequestState state)
+    {
+      decltype(req.continuations) continuations;
+      {
+        std::lock_guard<std::mutex> guard(req.completion_mtx);
+        req.state = state;
+        continuations.swap(req.continuations);
+      }
+      req.completion_cv.notify_all();
+
+      for (auto& c : continuations)
+        c(req);
+    }
+
+    // Register a continuation to run when a request completes; returns false
+    // (without running it) if the request has completed already.
+    bool when_complete(
+      RequestID id, std::function<void(const Request&)>&& continuation)
+    {
+      auto request = requests.find(id);
+      if (!request)
+        return false;
+
+      std::lock_guard<std::mutex> guard(request->completion_mtx);
+      if (is_final(request->state) || request->erased)
+        return false;
+      request->continuations.push_back(std::move(continuation));
+      return true;
+    }
+
+    bool when_complete(
+      RequestID id, std::function<void(RequestState)>&& continuation)
+    {
+      return when_complete(
+        id, [continuation = std::move(continuation)](const Request& req) {
+          continuation(req.erased ? RequestState::ERROR : req.state.load());
+        });
+    }
+
+    static bool is_final(RequestState state)
+    {
+      return state == RequestState::FINISHED || state == RequestState::ERROR;
+    }
+
+    static void fulfill(
+      std::promise<std::shared_ptr<Claims>>& promise, const Request& req)
+    {
+      if (req.state == RequestState::FINISHED && req.claims)
+        promise.set_value(req.claims);
+      else
+        promise.set_exception(std::make_exception_ptr(
+          std::runtime_error("attestation verification failed")));
+    }
+
+    RequestState wait_for(
+      RequestID id, std::optional<std::chrono::milliseconds> timeout) const
+    {
+      auto request = requests.find(id);
+      if (!request)
+        return RequestState::ERROR;
+
+      std::unique_lock<std::mutex> lock(request->completion_mtx);
+      auto done = [&request]() {
+        return is_final(request->state) || request->erased;
+      };
+      if (!timeout)
+        request->completion_cv.wait(lock, done);
+      else
+        request->completion_cv.wait_for(lock, *timeout, done);
+      return request->erased ? RequestState::ERROR : request->state.load();
+    }
+
+    std::future<std::shared_ptr<Claims>> get_future(RequestID id)
+    {
+      auto promise = std::make_shared<std::promise<std::shared_ptr<Claims>>>();
+      auto r = promise->get_future();
+
+      auto request = requests.find(id);
+      if (!request)
+      {
+        promise->set_exception(std::make_exception_ptr(
+          std::runtime_error("no such attestation verification request")));
+        return r;
+      }
+
+      auto fulfill_promise = [promise](const Request& req) {
+        fulfill(*promise, req);
+      };
+      if (!when_complete(id, fulfill_promise))
+        fulfill(*promise, *request);
+      return r;
+    }
+
     bool finished(RequestID id) const
     {
       return state(id) == RequestState::FINISHED;
@@ -151,50 +286,84 @@ namespace ravl
 
     bool completed(RequestID id) const
     {
-      return state(id) == RequestState::FINISHED ||
-        state(id) == RequestState::ERROR;
+      auto s = state(id);
+      return s == RequestState::FINISHED || s == RequestState::ERROR;
     }
 
     std::shared_ptr<Claims> result(RequestID id) const
     {
-      std::lock_guard<std::mutex> guard(requests_mtx);
-
-      auto rit = requests.find(id);
-      if (rit == requests.end())
+      auto request = requests.find(id);
+      if (!request)
         throw std::runtime_error("no such attestation verification request");
-      if (rit->second.state != RequestState::FINISHED)
+      if (request->state != RequestState::FINISHED)
         throw std::runtime_error(
           "attestation verification request not finished");
-      if (!rit->second.claims)
+      if (!request->claims)
         throw std::runtime_error("claim extraction failed");
-      return rit->second.claims;
+      return request->claims;
     }
 
     RAVL_VISIBILITY void erase(RequestID id)
     {
-      std::lock_guard<std::mutex> guard(requests_mtx);
+      auto request = requests.find(id);
+      if (!request || !requests.erase(id))
+        return;
 
-      auto rit = requests.find(id);
-      if (rit != requests.end())
+      decltype(request->continuations) continuations;
       {
-        if (http_client && rit->second.http_request_set_id)
-          http_client->erase(*rit->second.http_request_set_id);
-        requests.erase(rit);
+        std::lock_guard<std::mutex> guard(request->completion_mtx);
+        request->erased = true;
+        continuations.swap(request->continuations);
       }
+      request->completion_cv.notify_all();
+
+      for (auto& c : continuations)
+        c(*request);
+
+      // Downloads that are still in flight may be shared with other
+      // requests, in which case they are not cancelled.
+      if (
+        request->http_client && request->http_request_set_id &&
+        !detach_downloads(id))
+        request->http_client->erase(*request->http_request_set_id);
+    }
+
+    void refresh_endorsements(
+      std::shared_ptr<HTTPClient> http_client_, size_t lead_time)
+    {
+      std::lock_guard<std::mutex> guard(refresher_mtx);
+
+      if (!http_client_)
+        http_client_ = std::make_shared<SynchronousHTTPClient>();
+
+      refresher.reset();
+      refresher = std::make_unique<EndorsementRefresher>(
+        http_client_, std::chrono::seconds(lead_time));
     }
 
     AttestationRequestTracker::RequestID advance(RequestID id)
     {
-      Requests::iterator rit;
+      auto request = requests.find(id);
+      if (!request)
+        throw std::runtime_error("request not found");
 
-      {
-        std::lock_guard<std::mutex> guard(requests_mtx);
-        rit = requests.find(id);
-        if (rit == requests.end())
-          throw std::runtime_error("request not found");
-      }
+      return advance(id, *request);
+    }
+
+    bool find_verdict(Request& request)
+    {
+      if (!request.attestation)
+        throw std::runtime_error("no attestation to verify");
+
+      request.claims = ravl::find_verdict(
+        *request.attestation, request.options, request.verdict_ticket);
 
-      return advance(id, rit->second);
+      if (request.claims && request.options.verbosity > 0)
+        log(fmt::format(
+          "* Using cached verification result for attestation from {}",
+          to_string(request.attestation->source)));
+
+      return request.claims != nullptr;
     }
 
     bool prepare_endorsements(RequestID id, Request& request)
@@ -244,26 +413,429 @@ namespace ravl
         throw;
       }
 
-      if (http_requests)
+      // An empty set of requests is like none; nothing would complete it.
+      if (http_requests && !http_requests->empty())
       {
-        auto callback = [this, id](HTTPResponses&& r) {
+        std::vector<std::string> keys;
+        auto fresh = attach_downloads(id, *http_client_, *http_requests, keys);
+        if (!fresh.empty())
+        {
+          auto callback = [this, keys](HTTPResponses&& r) {
+            complete_downloads(keys, r);
+          };
+
+          try
           {
-            std::lock_guard<std::mutex> guard(responses_mtx);
-            auto [it, ok] = http_responses.emplace(id, r);
-            if (!ok)
-              throw std::bad_alloc();
+            request.http_request_set_id =
+              http_client_->submit(std::move(fresh), callback);
           }
-          advance(id);
-          advance(id);
-        };
-        request.http_request_set_id =
-          http_client_->submit(std::move(*http_requests), callback);
+          catch (...)
+          {
+            // Fail the other requests waiting for these downloads.
+            detach_downloads(id);
+            complete_downloads(keys, {});
+            throw;
+          }
+        }
         return true;
       }
 
       return false;
     }
 
+    // Downloads are shared by requests that use the same HTTP client (and
+    // therefore the same timeouts, retries, etc) and send the same request
+    // (URL, headers, mirrors, and body).
+    static std::string download_key(
+      const HTTPClient& client, const HTTPRequest& request)
+    {
+      std::string r =
+        fmt::format("{}\n{}\n", (const void*)&client, request.url);
+      std::map<std::string, std::string> headers(
+        request.headers.begin(), request.headers.end());
+      for (const auto& [k, v] : headers)
+        r += k + ": " + v + "\n";
+      for (const auto& mirror : request.mirrors)
+        r += mirror + "\n";
+      r += "\n" + request.body;
+      return r;
+    }
+
+    // Attach a request to the in-flight downloads of its HTTP requests and
+    // return those that are not being downloaded yet (with their keys in
+    // `fresh_keys`).
+    HTTPRequests attach_downloads(
+      RequestID id,
+      const HTTPClient& client,
+      const HTTPRequests& rs,
+      std::vector<std::string>& fresh_keys)
+    {
+      std::lock_guard<std::mutex> guard(downloads_mtx);
+
+      auto& pending = pending_downloads[id];
+      pending.responses.resize(rs.size());
+      pending.outstanding = rs.size();
+
+      HTTPRequests fresh;
+      for (size_t i = 0; i < rs.size(); i++)
+      {
+        auto key = download_key(client, rs[i]);
+        auto [it, inserted] = downloads.try_emplace(key);
+        it->second.emplace_back(id, i);
+        if (inserted)
+        {
+          fresh.push_back(rs[i]);
+          fresh_keys.push_back(key);
+        }
+        pending.keys.push_back(std::move(key));
+      }
+      pending.submitted = fresh_keys;
+      return fresh;
+    }
+
+    // Detach a request from the downloads it is waiting for; returns true if
+    // other requests still wait for downloads in its own HTTP request set
+    // (which must then not be cancelled).
+    bool detach_downloads(RequestID id)
+    {
+      std::lock_guard<std::mutex> guard(downloads_mtx);
+
+      auto pit = pending_downloads.find(id);
+      if (pit == pending_downloads.end())
+        return false;
+
+      for (const auto& key : pit->second.keys)
+      {
+        auto dit = downloads.find(key);
+        if (dit == downloads.end())
+          continue;
+        auto& waiters = dit->second;
+        std::erase_if(waiters, [id](const auto& w) { return w.first == id; });
+      }
+
+      bool shared = false;
+      for (const auto& key : pit->second.submitted)
+      {
+        auto dit = downloads.find(key);
+        if (dit != downloads.end() && !dit->second.empty())
+          shared = true;
+      }
+
+      // Downloads that nobody waits for anymore are cancelled with the set.
+      if (!shared)
+        for (const auto& key : pit->second.submitted)
+          downloads.erase(key);
+
+      pending_downloads.erase(pit);
+      return shared;
+    }
+
+    // Fan out the responses of a download to all requests waiting for them
+    // and advance those that have all their responses.
+    void complete_downloads(
+      const std::vector<std::string>& keys, const HTTPResponses& responses)
+    {
+      std::vector<std::pair<RequestID, HTTPResponses>> ready;
+
+      {
+        std::lock_guard<std::mutex> guard(downloads_mtx);
+
+        for (size_t j = 0; j < keys.size(); j++)
+        {
+          auto dit = downloads.find(keys[j]);
+          if (dit == downloads.end())
+            continue;
+
+          for (const auto& [id, i] : dit->second)
+          {
+            auto pit = pending_downloads.find(id);
+            if (pit == pending_downloads.end())
+              continue;
+
+            auto& pending = pit->second;
+            if (j < responses.size())
+              pending.responses[i] = responses[j];
+            if (--pending.outstanding == 0)
+            {
+              ready.emplace_back(id, std::move(pending.responses));
+              pending_downloads.erase(pit);
+            }
+          }
+
+          downloads.erase(dit);
+        }
+      }
+
+      for (auto& [id, r] : ready)
+      {
+        auto request = requests.find(id);
+        if (!request)
+          continue;
+        request->http_responses = std::move(r);
+        advance(id, *request);
+        verification_pool.submit(
+          [this, id, request]() { advance(id, *request); });
+      }
+    }
+
+    using BatchResult = AttestationRequestTracker::BatchResult;
+
+    BatchResult verify_batch(
+      std::span<const std::shared_ptr<const Attestation>> attestations,
+      const Options& options,
+      std::shared_ptr<HTTPClient> http_client_)
+    {
+      using Clock = std::chrono::steady_clock;
+      using std::chrono::duration_cast;
+      using std::chrono::microseconds;
+
+      auto start = Clock::now();
+      size_t n = attestations.size();
+
+      BatchResult r;
+      r.claims.resize(n);
+      r.errors.resize(n);
+      r.statistics.attestations = n;
+
+      // Group the attestations by the endorsements they need (by URL; e.g.
+      // per FMSPC and CA for SGX, per chip ID and TCB for SEV-SNP).
+      struct Group
+      {
+        HTTPRequests requests;
+        std::optional<HTTPResponses> responses = std::nullopt;
+        std::string error = "";
+      };
+
+      static constexpr size_t no_group = SIZE_MAX;
+      std::vector<Group> groups;
+      std::unordered_map<std::string, size_t> group_index;
+      std::vector<size_t> group_of(n, no_group);
+      std::vector<std::optional<VerdictCacheTicket>> tickets(n);
+      std::vector<size_t> to_verify;
+
+      for (size_t i = 0; i < n; i++)
+      {
+        try
+        {
+          if (!attestations[i])
+            throw std::runtime_error("no attestation to verify");
+
+          const auto& attestation = *attestations[i];
+          auto claims = ravl::find_verdict(attestation, options, tickets[i]);
+          if (claims)
+          {
+            r.claims[i] = claims;
+            r.statistics.cached_verdicts++;
+            continue;
+          }
+
+          auto http_requests = attestation.prepare_endorsements(options);
+          if (http_requests && !http_requests->empty())
+          {
+            std::string key;
+            for (const auto& request : *http_requests)
+              key += request.url + "\n";
+
+            auto [it, inserted] = group_index.try_emplace(key, groups.size());
+            if (inserted)
+              groups.push_back({std::move(*http_requests)});
+            group_of[i] = it->second;
+          }
+
+          to_verify.push_back(i);
+        }
+        catch (const std::exception& ex)
+        {
+          r.errors[i] = ex.what();
+        }
+      }
+
+      r.statistics.endorsement_sets = groups.size();
+      auto prepared = Clock::now();
+
+      if (!groups.empty() && !http_client_)
+        http_client_ = std::make_shared<SynchronousHTTPClient>(
+          options.http_timeout,
+          options.http_max_attempts,
+          options.verbosity > 0,
+          options.http_connection_idle_timeout,
+          options.http2,
+          options.http_compression);
+
+      // Completion of downloads and verifications, shared with the HTTP
+      // client's callbacks and the verification tasks, which may still hold
+      // on to it after this returns.
+      struct Completion
+      {
+        std::mutex mtx;
+        std::condition_variable cv;
+        size_t outstanding = 0;
+      };
+
+      // A download of the endorsements of some of the groups, as one request
+      // set
+      struct Download
+      {
+        std::vector<size_t> groups;
+        HTTPResponses responses = {};
+        std::optional<std::string> error = std::nullopt;
+        bool delivered = false;
+      };
+
+      auto fetches = std::make_shared<Completion>();
+
+      auto download = [&](std::vector<size_t> members) {
+        auto d = std::make_shared<Download>();
+        d->groups = std::move(members);
+
+        HTTPRequests requests_;
+        for (auto g : d->groups)
+          requests_.insert(
+            requests_.end(),
+            groups[g].requests.begin(),
+            groups[g].requests.end());
+
+        {
+          std::lock_guard<std::mutex> guard(fetches->mtx);
+          fetches->outstanding++;
+        }
+
+        try
+        {
+          http_client_->submit(
+            std::move(requests_),
+            [fetches, d](HTTPResponses&& responses) {
+              std::lock_guard<std::mutex> guard(fetches->mtx);
+              if (d->error)
+                return;
+              d->responses = std::move(responses);
+              d->delivered = true;
+              fetches->outstanding--;
+              fetches->cv.notify_all();
+            });
+        }
+        catch (const std::exception& ex)
+        {
+          std::lock_guard<std::mutex> guard(fetches->mtx);
+          if (!d->delivered)
+          {
+            d->error = ex.what();
+            fetches->outstanding--;
+          }
+        }
+
+        return d;
+      };
+
+      auto wait_for_all = [](Completion& c) {
+        std::unique_lock<std::mutex> lock(c.mtx);
+        c.cv.wait(lock, [&c]() { return c.outstanding == 0; });
+      };
+
+      // Download all endorsement sets at once, as one request set (which
+      // even a SynchronousHTTPClient executes concurrently). Clients may fail
+      // a whole set if one of its requests fails (e.g. SynchronousHTTPClient
+      // throws), so after a failure the groups are downloaded one by one, and
+      // only the groups whose downloads fail are failed.
+      std::vector<std::shared_ptr<Download>> done;
+      if (!groups.empty())
+      {
+        std::vector<size_t> all(groups.size());
+        for (size_t g = 0; g < groups.size(); g++)
+          all[g] = g;
+        done.push_back(download(std::move(all)));
+        wait_for_all(*fetches);
+
+        if (done[0]->error && groups.size() > 1)
+        {
+          done.clear();
+          for (size_t g = 0; g < groups.size(); g++)
+            done.push_back(download({g}));
+          wait_for_all(*fetches);
+        }
+      }
+
+      for (auto& d : done)
+      {
+        size_t offset = 0;
+        for (auto g : d->groups)
+        {
+          auto& group = groups[g];
+          size_t k = group.requests.size();
+          if (d->error)
+            group.error = *d->error;
+          else if (d->responses.size() < offset + k)
+            group.error = "missing responses";
+          else
+            group.responses = HTTPResponses(
+              std::make_move_iterator(d->responses.begin() + offset),
+              std::make_move_iterator(d->responses.begin() + offset + k));
+          offset += k;
+        }
+      }
+
+      auto downloaded = Clock::now();
+
+      // Verify in parallel. When called from a worker of the verification
+      // pool, waiting for tasks on that pool could wait for this very worker,
+      // so a temporary pool is used instead, as when there is no pool.
+      std::unique_ptr<WorkerPool> batch_pool;
+      WorkerPool* pool = &verification_pool;
+      if (pool->size() == 0 || pool->on_worker())
+      {
+        size_t threads = 0;
+        if (to_verify.size() > 1)
+          threads = std::min<size_t>(
+            to_verify.size(),
+            std::max(1u, std::thread::hardware_concurrency()));
+        batch_pool = std::make_unique<WorkerPool>(
+          WorkerPoolOptions{.threads = threads});
+        pool = batch_pool.get();
+      }
+
+      auto verifications = std::make_shared<Completion>();
+      verifications->outstanding = to_verify.size();
+      for (auto i : to_verify)
+      {
+        pool->submit([&, i, verifications]() {
+          try
+          {
+            static const std::optional<HTTPResponses> none = std::nullopt;
+            const auto& responses =
+              group_of[i] == no_group ? none : groups[group_of[i]].responses;
+            if (group_of[i] != no_group && !groups[group_of[i]].error.empty())
+              throw std::runtime_error(fmt::format(
+                "endorsement download failed: {}",
+                groups[group_of[i]].error));
+
+            auto claims = attestations[i]->verify(options, responses);
+            if (tickets[i])
+              cache_verdict(*tickets[i], options, claims);
+            r.claims[i] = claims;
+          }
+          catch (const std::exception& ex)
+          {
+            r.errors[i] = ex.what();
+          }
+
+          std::lock_guard<std::mutex> guard(verifications->mtx);
+          verifications->outstanding--;
+          verifications->cv.notify_all();
+        });
+      }
+
+      wait_for_all(*verifications);
+
+      auto end = Clock::now();
+      auto& s = r.statistics;
+      s.preparation_time = duration_cast<microseconds>(prepared - start);
+      s.download_time = duration_cast<microseconds>(downloaded - prepared);
+      s.verification_time = duration_cast<microseconds>(end - downloaded);
+      s.total_time = duration_cast<microseconds>(end - start);
+
+      return r;
+    }
+
     void verify(RequestID id, Request& request)
     {
       if (!request.attestation)
@@ -277,16 +849,8 @@ namespace ravl
 
       try
       {
-        std::lock_guard<std::mutex> guard(responses_mtx);
-        std::vector<HTTPResponse> responses;
-
-        auto rit = http_responses.find(id);
-        if (rit != http_responses.end())
-        {
-          responses.swap(rit->second);
-          http_responses.erase(rit);
-        }
-
+        HTTPResponses responses;
+        responses.swap(request.http_responses);
         claims = attestation.verify(options, responses);
       }
       catch (const std::exception& ex)
@@ -298,13 +862,17 @@ namespace ravl
       if (options.verbosity > 0)
         log("  - verification successful");
 
+      if (request.verdict_ticket)
+        cache_verdict(*request.verdict_ticket, options, claims);
+
       request.claims = claims;
     }
   };
 
-  RAVL_VISIBILITY AttestationRequestTracker::AttestationRequestTracker()
+  RAVL_VISIBILITY AttestationRequestTracker::AttestationRequestTracker(
+    const WorkerPoolOptions& verification_pool)
   {
-    implementation = new AttestationRequestTrackerImpl();
+    implementation = new AttestationRequestTrackerImpl(verification_pool);
   }
 
   RAVL_VISIBILITY AttestationRequestTracker::~AttestationRequestTracker()
@@ -349,6 +917,45 @@ namespace ravl
       ->result(id);
   }
 
+  RAVL_VISIBILITY AttestationRequestTracker::RequestState
+  AttestationRequestTracker::wait(RequestID id) const
+  {
+    return static_cast<AttestationRequestTrackerImpl*>(implementation)
+      ->wait_for(id, std::nullopt);
+  }
+
+  RAVL_VISIBILITY AttestationRequestTracker::RequestState
+  AttestationRequestTracker::wait_for(
+    RequestID id, std::chrono::milliseconds timeout) const
+  {
+    return static_cast<AttestationRequestTrackerImpl*>(implementation)
+      ->wait_for(id, timeout);
+  }
+
+  RAVL_VISIBILITY std::future<std::shared_ptr<Claims>>
+  AttestationRequestTracker::get_future(RequestID id)
+  {
+    return static_cast<AttestationRequestTrackerImpl*>(implementation)
+      ->get_future(id);
+  }
+
+  RAVL_VISIBILITY bool AttestationRequestTracker::when_complete(
+    RequestID id, std::function<void(RequestState)>&& continuation)
+  {
+    return static_cast<AttestationRequestTrackerImpl*>(implementation)
+      ->when_complete(id, std::move(continuation));
+  }
+
+  RAVL_VISIBILITY AttestationRequestTracker::BatchResult
+  AttestationRequestTracker::verify_batch(
+    std::span<const std::shared_ptr<const Attestation>> attestations,
+    const Options& options,
+    std::shared_ptr<HTTPClient> http_client)
+  {
+    return static_cast<AttestationRequestTrackerImpl*>(implementation)
+      ->verify_batch(attestations, options, http_client);
+  }
+
   RAVL_VISIBILITY void AttestationRequestTracker::erase(RequestID id)
   {
     static_cast<AttestationRequestTrackerImpl*>(implementation)->erase(id);
@@ -360,4 +967,11 @@ namespace ravl
     return static_cast<AttestationRequestTrackerImpl*>(implementation)
       ->advance(id);
   }
+
+  RAVL_VISIBILITY void AttestationRequestTracker::refresh_endorsements(
+    std::shared_ptr<HTTPClient> http_client, size_t lead_time)
+  {
+    static_cast<AttestationRequestTrackerImpl*>(implementation)
+      ->refresh_endorsements(http_client, lead_time);
+  }
 }
\ No newline at end of file
@@ -75,6 +75,8 @@ namespace ravl
       Endorsements endorsements;
 
       virtual std::string to_json() const override;
+
+      virtual std::shared_ptr<ravl::Claims> clone() const override;
     };
 
     class Attestation : public ravl::Attestation
@@ -101,6 +103,8 @@ namespace ravl
       virtual std::shared_ptr<ravl::Claims> verify(
         const Options& options = {},
         const std::optional<HTTPResponses>& http_responses = {}) const override;
+
+      virtual std::string platform_id() const override;
     };
   }
 }
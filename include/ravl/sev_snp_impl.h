@@ -3,11 +3,15 @@
 
 #pragma once
 
+#include "cache.h"
 #include "crypto.h"
+#include "endorsement_refresher.h"
+#include "endorsement_store.h"
 #include "http_client.h"
 #include "json.h"
 #include "sev_snp.h"
 #include "util.h"
+#include "verdict_cache.h"
 #include "visibility.h"
 
 #include <span>
@@ -258,6 +262,11 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       return ravl::json(*this).dump();
     }
 
+    RAVL_VISIBILITY std::shared_ptr<ravl::Claims> Claims::clone() const
+    {
+      return std::make_shared<Claims>(*this);
+    }
+
 #define SEV_GUEST_IOC_TYPE 'S'
 #define SEV_SNP_GUEST_MSG_REPORT \
   _IOWR(SEV_GUEST_IOC_TYPE, 0x1, struct snp::GuestRequest)
@@ -291,6 +300,58 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       return requests;
     }
 
+    RAVL_VISIBILITY HTTPRequests download_endorsements(
+      const std::string& product_name,
+      const std::span<const uint8_t>& chip_id,
+      const snp::TcbVersion& tcb_version,
+      const Options& options)
+    {
+      HTTPRequests requests;
+
+      auto hwid = fmt::format("{:02x}", fmt::join(chip_id, ""));
+      auto vcek_issuer_crl_url =
+        fmt::format("{}/vcek/v1/{}/crl", kds_url, product_name);
+
+      if (options.sev_snp_endorsement_cache_url_template)
+      {
+        auto tcb_version_str = fmt::format("{:08x}", *(uint64_t*)&tcb_version);
+        const auto& url_template =
+          *options.sev_snp_endorsement_cache_url_template;
+        auto chain_url = fmt::vformat(
+          url_template, fmt::make_format_args(hwid, tcb_version_str));
+
+        HTTPRequest chain_request(chain_url);
+        const auto& mirrors = options.sev_snp_endorsement_cache_url_mirrors;
+        for (const auto& mirror : mirrors)
+          chain_request.mirrors.push_back(fmt::vformat(
+            mirror, fmt::make_format_args(hwid, tcb_version_str)));
+        requests.push_back(std::move(chain_request));
+
+        // TODO: Does the cache also provide CRLs?
+        requests.emplace_back(vcek_issuer_crl_url);
+      }
+      else
+      {
+        // https://www.amd.com/system/files/TechDocs/57230.pdf Chapter 4
+        auto tcb_parameters = fmt::format(
+          "blSPL={}&teeSPL={}&snpSPL={}&ucodeSPL={}",
+          tcb_version.boot_loader,
+          tcb_version.tee,
+          tcb_version.snp,
+          tcb_version.microcode);
+        auto vcek_url = fmt::format(
+          "{}/vcek/v1/{}/{}?{}", kds_url, product_name, hwid, tcb_parameters);
+        auto vcek_issuer_chain_url =
+          fmt::format("{}/vcek/v1/{}/cert_chain", kds_url, product_name);
+
+        requests.emplace_back(vcek_url);
+        requests.emplace_back(vcek_issuer_chain_url);
+        requests.emplace_back(vcek_issuer_crl_url);
+      }
+
+      return requests;
+    }
+
     struct EndorsementsEtc
     {
       std::optional<crypto::UqX509> root_ca_certificate;
@@ -329,8 +390,72 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       }
     };
 
+    RAVL_VISIBILITY std::string get_product_name(
+      const snp::Attestation& snp_att)
+    {
+      return "Milan"; // TODO: How can we determine that from snp_att?
+    }
+
+    struct VCEKKey
+    {
+      std::string product_name;
+      std::array<uint8_t, 64> chip_id;
+      uint64_t reported_tcb;
+
+      auto operator<=>(const VCEKKey&) const = default;
+    };
+
+    RAVL_VISIBILITY VCEKKey vcek_key(const snp::Attestation& snp_att)
+    {
+      VCEKKey r;
+      r.product_name = get_product_name(snp_att);
+      copy(r.chip_id, snp_att.chip_id);
+      static_assert(sizeof(r.reported_tcb) == sizeof(snp_att.reported_tcb));
+      std::memcpy(
+        &r.reported_tcb, &snp_att.reported_tcb, sizeof(r.reported_tcb));
+      return r;
+    }
+
+    RAVL_VISIBILITY HTTPRequests
+    download_endorsements(const VCEKKey& key, const Options& options)
+    {
+      snp::TcbVersion tcb_version;
+      static_assert(sizeof(tcb_version) == sizeof(key.reported_tcb));
+      std::memcpy(&tcb_version, &key.reported_tcb, sizeof(tcb_version));
+      return download_endorsements(
+        key.product_name, key.chip_id, tcb_version, options);
+    }
+
+    // VCEK issuer certificates (ASK, ARK) and CRL, shared by all chips of a
+    // product.
+    struct ProductEndorsements
+    {
+      crypto::UqStackOfX509 issuer_chain;
+      std::optional<crypto::UqX509_CRL> crl;
+    };
+
+    static constexpr size_t vcek_cache_max_entries = 4096;
+
+    using VCEKCache =
+      ExpiringCache<VCEKKey, std::shared_ptr<const crypto::UqX509>>;
+    using ProductEndorsementsCache =
+      ExpiringCache<std::string, std::shared_ptr<const ProductEndorsements>>;
+
+    RAVL_VISIBILITY VCEKCache& vcek_cache()
+    {
+      static VCEKCache cache(vcek_cache_max_entries);
+      return cache;
+    }
+
+    RAVL_VISIBILITY ProductEndorsementsCache& product_endorsements_cache()
+    {
+      static ProductEndorsementsCache cache;
+      return cache;
+    }
+
     RAVL_VISIBILITY EndorsementsEtc parse_url_responses(
-      const Options& options, const std::vector<HTTPResponse>& http_responses)
+      const Options& options,
+      const std::vector<HTTPResponse>& http_responses)
     {
       using namespace crypto;
 
@@ -394,51 +519,165 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       return r;
     }
 
-    RAVL_VISIBILITY HTTPRequests download_endorsements(
-      const std::string& product_name,
-      const std::span<const uint8_t>& chip_id,
-      const snp::TcbVersion& tcb_version,
-      const Options& options)
+    // Endorsements are cached (and stored) only once they have verified an
+    // attestation. Cached verdicts for the product are invalidated when the
+    // CRL changes, and the CRL is renewed (via the endorsements of the chip
+    // that was seen last) before it expires; the renewed endorsements replace
+    // the cached ones only if they verify the same attestation.
+    RAVL_VISIBILITY void cache_endorsements(
+      const VCEKKey& key,
+      const EndorsementsEtc& endorsements,
+      const Options& options,
+      const std::vector<uint8_t>& evidence,
+      std::shared_ptr<const HTTPResponses> responses,
+      bool store)
     {
-      HTTPRequests requests;
-
-      auto hwid = fmt::format("{:02x}", fmt::join(chip_id, ""));
-      auto vcek_issuer_crl_url =
-        fmt::format("{}/vcek/v1/{}/crl", kds_url, product_name);
+      using namespace crypto;
 
-      if (options.sev_snp_endorsement_cache_url_template)
+      try
       {
-        auto tcb_version_str = fmt::format("{:08x}", *(uint64_t*)&tcb_version);
-        const auto& url_template =
-          *options.sev_snp_endorsement_cache_url_template;
-        auto chain_url = fmt::vformat(
-          url_template, fmt::make_format_args(hwid, tcb_version_str));
+        const auto& chain = endorsements.vcek_certificate_chain;
+        if (chain.size() != 3)
+          throw std::runtime_error("unexpected certificate chain length");
+
+        auto vcek = std::make_shared<const UqX509>(chain.at(0));
+        auto vcek_expiry = to_time_point(X509_get0_notAfter(*vcek));
+        vcek_cache().insert(key, vcek, vcek_expiry);
+
+        if (!endorsements.vcek_issuer_chain_crl)
+          return;
+
+        auto pe = std::make_shared<ProductEndorsements>();
+        for (size_t i = 1; i < chain.size(); i++)
+          pe->issuer_chain.push(chain.at(i));
+        pe->crl = endorsements.vcek_issuer_chain_crl;
+        auto expiry = to_time_point(X509_CRL_get0_nextUpdate(*pe->crl));
+
+        auto& cache = product_endorsements_cache();
+        auto previous = cache.find(key.product_name);
+        cache.insert(key.product_name, pe, expiry);
+
+        if (
+          !previous || !(*previous)->crl ||
+          X509_CRL_match(*(*previous)->crl, *pe->crl) != 0)
+          verdict_cache().invalidate("sev-snp:" + key.product_name);
+
+        if (store && options.endorsement_store_path)
+          EndorsementStore::get(*options.endorsement_store_path)
+            ->insert(
+              download_endorsements(key, options),
+              *responses,
+              std::min(vcek_expiry, expiry));
+
+        auto renewal_options = options;
+        renewal_options.verbosity = 0;
+        renewal_options.fresh_endorsements = false;
+        renewal_options.fresh_root_ca_certificate = false;
+
+        auto attestation =
+          std::make_shared<const Attestation>(evidence, std::vector<uint8_t>());
+
+        endorsement_refresh_schedule().schedule(
+          "sev-snp:" + key.product_name,
+          expiry,
+          [key, renewal_options]() {
+            return download_endorsements(key, renewal_options);
+          },
+          [attestation, renewal_options](HTTPResponses&& renewed) {
+            attestation->verify(renewal_options, renewed);
+          },
+          std::move(responses));
+      }
+      catch (const std::exception& ex)
+      {
+        if (options.verbosity > 0)
+          log(fmt::format("- endorsements not cached: {}", ex.what()), 2);
+      }
+    }
 
-        requests.emplace_back(chain_url);
+    struct CachedEndorsements
+    {
+      EndorsementsEtc endorsements;
 
-        // TODO: Does the cache also provide CRLs?
-        requests.emplace_back(vcek_issuer_crl_url);
+      /// Responses that the endorsements were made from, if they were loaded
+      /// from the endorsement store (and are not cached in-process yet)
+      std::shared_ptr<const HTTPResponses> stored_responses = nullptr;
+    };
+
+    RAVL_VISIBILITY std::optional<CachedEndorsements> find_stored_endorsements(
+      const VCEKKey& key, const Options& options)
+    {
+      if (!options.endorsement_store_path)
+        return std::nullopt;
+
+      try
+      {
+        auto responses = EndorsementStore::get(*options.endorsement_store_path)
+                           ->find(download_endorsements(key, options));
+        if (!responses)
+          return std::nullopt;
+
+        return CachedEndorsements{
+          parse_url_responses(options, *responses),
+          std::make_shared<const HTTPResponses>(std::move(*responses))};
       }
-      else
+      catch (const std::exception& ex)
       {
-        // https://www.amd.com/system/files/TechDocs/57230.pdf Chapter 4
-        auto tcb_parameters = fmt::format(
-          "blSPL={}&teeSPL={}&snpSPL={}&ucodeSPL={}",
-          tcb_version.boot_loader,
-          tcb_version.tee,
-          tcb_version.snp,
-          tcb_version.microcode);
-        auto vcek_url = fmt::format(
-          "{}/vcek/v1/{}/{}?{}", kds_url, product_name, hwid, tcb_parameters);
-        auto vcek_issuer_chain_url =
-          fmt::format("{}/vcek/v1/{}/cert_chain", kds_url, product_name);
-
-        requests.emplace_back(vcek_url);
-        requests.emplace_back(vcek_issuer_chain_url);
-        requests.emplace_back(vcek_issuer_crl_url);
+        if (options.verbosity > 0)
+          log(fmt::format("- stored endorsements not used: {}", ex.what()), 2);
+        return std::nullopt;
       }
+    }
 
-      return requests;
+    RAVL_VISIBILITY std::optional<CachedEndorsements> find_cached_endorsements(
+      const VCEKKey& key, const Options& options)
+    {
+      if (
+        !options.cache_endorsements || options.fresh_endorsements ||
+        options.fresh_root_ca_certificate)
+        return std::nullopt;
+
+      auto vcek = vcek_cache().find(key);
+      auto pe = product_endorsements_cache().find(key.product_name);
+      if (!vcek || !pe)
+        return find_stored_endorsements(key, options);
+
+      CachedEndorsements r;
+      r.endorsements.vcek_certificate_chain = (*pe)->issuer_chain;
+      r.endorsements.vcek_certificate_chain.insert(0, crypto::UqX509(**vcek));
+      r.endorsements.root_ca_certificate = (*pe)->issuer_chain.back();
+      r.endorsements.vcek_issuer_chain_crl = (*pe)->crl;
+      return r;
+    }
+
+    RAVL_VISIBILITY std::shared_ptr<const crypto::TrustStore> get_trust_store(
+      EndorsementsEtc& endorsements)
+    {
+      using namespace crypto;
+
+      auto digest = [](auto fn, const auto* obj) {
+        std::string r(EVP_MAX_MD_SIZE, '\0');
+        unsigned int sz = 0;
+        OpenSSL::CHECK1(fn(obj, EVP_sha256(), (unsigned char*)r.data(), &sz));
+        r.resize(sz);
+        return r;
+      };
+
+      // Without a root CA certificate, the root of the VCEK certificate chain
+      // is auto-trusted.
+      bool trusted_root = !endorsements.root_ca_certificate;
+      UqX509 root = trusted_root ? endorsements.vcek_certificate_chain.back() :
+                                   *endorsements.root_ca_certificate;
+      auto& crl = endorsements.vcek_issuer_chain_crl;
+
+      auto key = trust_store_key(
+        {digest(X509_digest, (const X509*)root),
+         crl ? digest(X509_CRL_digest, (const X509_CRL*)*crl) : ""});
+
+      return crypto::get_trust_store(key, [&root, &crl](UqX509_STORE& store) {
+        store.add_crl(crl);
+        store.add(root);
+      });
     }
 
     RAVL_VISIBILITY bool verify_signature(
@@ -453,6 +692,14 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       return pkey.verify_signature(hash, sig_der);
     }
 
+    RAVL_VISIBILITY std::string Attestation::platform_id() const
+    {
+      const auto& snp_att =
+        *reinterpret_cast<const ravl::sev_snp::snp::Attestation*>(
+          evidence.data());
+      return "sev-snp:" + get_product_name(snp_att);
+    }
+
     RAVL_VISIBILITY std::optional<HTTPRequests> Attestation::
       prepare_endorsements(const Options& options) const
     {
@@ -463,8 +710,7 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       if (snp_att.version != 2)
         throw std::runtime_error("unsupported attestation format version");
 
-      std::string product_name =
-        "Milan"; // TODO: How can we determine that from snp_att?
+      std::string product_name = get_product_name(snp_att);
 
       std::optional<HTTPRequests> r = std::nullopt;
 
@@ -475,6 +721,9 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       }
       else
       {
+        if (find_cached_endorsements(vcek_key(snp_att), options))
+          return std::nullopt;
+
         r = download_endorsements(
           product_name, snp_att.chip_id, snp_att.reported_tcb, options);
       }
@@ -542,19 +791,19 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
     {
       using namespace crypto;
 
-      if (endorsements.empty() && (!http_responses || http_responses->empty()))
-        throw std::runtime_error("missing endorsements");
-
       size_t indent = 0;
 
       const auto& snp_att =
         *reinterpret_cast<const ravl::sev_snp::snp::Attestation*>(
           evidence.data());
 
-      UqX509_STORE store;
-
       EndorsementsEtc endorsements_etc;
 
+      // Downloaded or stored endorsements are cached once verification
+      // succeeds.
+      std::shared_ptr<const HTTPResponses> cache_responses = nullptr;
+      bool downloaded = false;
+
       if (!endorsements.empty() && !options.fresh_endorsements)
       {
         endorsements_etc.vcek_certificate_chain = vec2str(endorsements);
@@ -565,33 +814,38 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
           endorsements_etc.root_ca_certificate =
             parse_root_cert(*http_responses);
       }
+      else if (http_responses && !http_responses->empty())
+      {
+        endorsements_etc = parse_url_responses(options, *http_responses);
+        if (options.cache_endorsements)
+        {
+          cache_responses =
+            std::make_shared<const HTTPResponses>(*http_responses);
+          downloaded = true;
+        }
+      }
       else
       {
-        if (!http_responses)
+        auto cached = find_cached_endorsements(vcek_key(snp_att), options);
+        if (!cached)
           throw std::runtime_error("missing endorsements");
-        endorsements_etc = parse_url_responses(options, *http_responses);
+        endorsements_etc = std::move(cached->endorsements);
+        cache_responses = std::move(cached->stored_responses);
       }
 
       if (options.verbosity > 0)
         log(endorsements_etc.to_string(options.verbosity, indent));
 
-      store.set_flags(X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
-      store.add_crl(endorsements_etc.vcek_issuer_chain_crl);
-
-      bool trusted_root = false;
-
-      if (endorsements_etc.root_ca_certificate)
-        store.add(*endorsements_etc.root_ca_certificate);
-      else
-        trusted_root = true;
+      bool trusted_root = !endorsements_etc.root_ca_certificate;
+      auto trust_store = get_trust_store(endorsements_etc);
 
       if (options.verbosity > 0)
         log("- VCEK issuer certificate chain verification", indent + 2);
       auto chain = crypto::verify_certificate_chain(
         endorsements_etc.vcek_certificate_chain,
-        store,
+        trust_store->get(),
         options.certificate_verification,
-        trusted_root,
+        false,
         options.verbosity,
         indent + 4);
 
@@ -622,6 +876,15 @@ QPHfbkH0CyPfhl1jWhJFZasCAwEAAQ==
       if (!verify_signature(vcek_pk, msg, snp_att.signature))
         throw std::runtime_error("invalid VCEK signature");
 
+      if (cache_responses)
+        cache_endorsements(
+          vcek_key(snp_att),
+          endorsements_etc,
+          options,
+          evidence,
+          std::move(cache_responses),
+          downloaded);
+
       if (trusted_root)
         endorsements_etc.root_ca_certificate = chain.at(2);
 
@@ -85,6 +85,8 @@ namespace ravl
 
       virtual std::string to_json() const override;
 
+      virtual std::shared_ptr<ravl::Claims> clone() const override;
+
       virtual std::vector<uint8_t> to_cbor() const;
     };
 
@@ -106,6 +108,8 @@ namespace ravl
         const Options& options = {},
         const std::optional<HTTPResponses>& http_responses = {}) const override;
 
+      virtual std::string platform_id() const override;
+
       void compress_pck_certificate_chain(bool resize_evidence = true);
 
       std::shared_ptr<ravl::Claims> partial_verify(
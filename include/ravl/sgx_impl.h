@@ -3,13 +3,17 @@
 
 #pragma once
 
+#include "cache.h"
 #include "crypto.h"
+#include "endorsement_refresher.h"
+#include "endorsement_store.h"
 #include "http_client.h"
 #include "json.h"
 #include "openssl.hpp"
 #include "sgx.h"
 #include "sgx_defs.h"
 #include "util.h"
+#include "verdict_cache.h"
 #include "visibility.h"
 
 #include <vector>
@@ -105,6 +109,11 @@ namespace ravl
       return ravl::json::to_cbor(j);
     }
 
+    RAVL_VISIBILITY std::shared_ptr<ravl::Claims> Claims::clone() const
+    {
+      return std::make_shared<Claims>(*this);
+    }
+
     class QL_QVE_Collateral // ~ sgx_ql_qve_collateral_t
     {
     public:
@@ -224,6 +233,34 @@ namespace ravl
       }
     };
 
+    struct CollateralKey
+    {
+      std::string fmspc;
+      std::string ca_type;
+      bool qve = false;
+
+      /// URLs (and mirrors) the collateral is downloaded from; collateral
+      /// from one endorsement cache is not served to callers that use another.
+      std::string source;
+
+      auto operator<=>(const CollateralKey&) const = default;
+    };
+
+    using CollateralCache =
+      ExpiringCache<CollateralKey, std::shared_ptr<const QL_QVE_Collateral>>;
+
+    RAVL_VISIBILITY CollateralCache& collateral_cache()
+    {
+      static CollateralCache cache;
+      return cache;
+    }
+
+    RAVL_VISIBILITY std::string platform_id(const CollateralKey& key)
+    {
+      return "sgx:" + key.fmspc;
+    }
+
+
     RAVL_VISIBILITY bool verify_signature(
       crypto::UqEVP_PKEY& pkey,
       const std::span<const uint8_t>& message,
@@ -332,27 +369,51 @@ namespace ravl
       {
         if (!options.root_ca_certificate)
           requests.emplace_back(root_ca_url);
-        auto tmpl = *options.sgx_endorsement_cache_url_template;
-        requests.emplace_back(
-          fmt::vformat(tmpl, fmt::make_format_args("pckcrl", root_crl_url)));
+
+        // Same request for the cache and each of its mirrors
+        auto add = [&options, &requests](
+                     const std::string& name, const std::string& def) {
+          auto tmpl = *options.sgx_endorsement_cache_url_template;
+          HTTPRequest request(
+            fmt::vformat(tmpl, fmt::make_format_args(name, def)));
+          for (const auto& mirror : options.sgx_endorsement_cache_url_mirrors)
+            request.mirrors.push_back(
+              fmt::vformat(mirror, fmt::make_format_args(name, def)));
+          requests.push_back(std::move(request));
+        };
+
+        add("pckcrl", root_crl_url);
 	auto tcb_def = tcb_url + "&fmspc=" + fmspc;
-        requests.emplace_back(fmt::vformat(
-          tmpl, fmt::make_format_args("tcb", tcb_def)));
+        add("tcb", tcb_def);
 	auto pck_def = intel_certificates_url_base + "/intelsgxpck" + ca + ".crl" + "&encoding=pem";
-        requests.emplace_back(fmt::vformat(
-          tmpl,
-          fmt::make_format_args("pckcrl", pck_def)));
+        add("pckcrl", pck_def);
         if (!qve)
-          requests.emplace_back(fmt::vformat(
-            tmpl, fmt::make_format_args("qe/identity", qe_identity_url)));
+          add("qe/identity", qe_identity_url);
         else
-          requests.emplace_back(fmt::vformat(
-            tmpl, fmt::make_format_args("qve/identity", qve_identity_url)));
+          add("qve/identity", qve_identity_url);
       }
 
       return requests;
     }
 
+    RAVL_VISIBILITY std::string collateral_source(
+      const CollateralKey& key, const Options& options)
+    {
+      // The root CA certificate is checked against Intel's key, regardless of
+      // where it comes from.
+      std::string r;
+      for (const auto& request :
+           download_collateral(key.ca_type, key.fmspc, options, key.qve))
+      {
+        if (request.url == root_ca_url)
+          continue;
+        r += request.url + " ";
+        for (const auto& mirror : request.mirrors)
+          r += mirror + " ";
+      }
+      return r;
+    }
+
     RAVL_VISIBILITY bool json_vector_eq(
       const ravl::json& tcbinfo_j,
       const std::string& key,
@@ -382,6 +443,22 @@ namespace ravl
         throw std::runtime_error(name + " earlier than permitted");
     }
 
+    RAVL_VISIBILITY std::chrono::system_clock::time_point collateral_expiry(
+      const QL_QVE_Collateral& collateral)
+    {
+      auto tcb_info_j = ravl::json::parse(collateral.tcb_info);
+      auto tcb_info_next_update = parse_time_point(
+        tcb_info_j["tcbInfo"]["nextUpdate"].get<std::string>(),
+        datetime_format);
+
+      auto qe_identity_j = ravl::json::parse(collateral.qe_identity);
+      auto qe_identity_next_update = parse_time_point(
+        qe_identity_j["enclaveIdentity"]["nextUpdate"].get<std::string>(),
+        datetime_format);
+
+      return std::min(tcb_info_next_update, qe_identity_next_update);
+    }
+
     RAVL_VISIBILITY void check_http_200(
       const HTTPResponse& response, const std::string& name)
     {
@@ -392,7 +469,7 @@ namespace ravl
     RAVL_VISIBILITY std::shared_ptr<QL_QVE_Collateral> consume_url_responses(
       const Options& options,
       const std::vector<HTTPResponse>& http_responses,
-      const std::shared_ptr<QL_QVE_Collateral>& collateral,
+      const std::shared_ptr<const QL_QVE_Collateral>& collateral,
       bool qve = false)
     {
       size_t expected_responses = 0;
@@ -461,6 +538,130 @@ namespace ravl
       return r;
     }
 
+    // Collateral is cached (and stored) only once it has verified an
+    // attestation. Cached verdicts for the platform are invalidated when its
+    // TCB info or CRLs change, and the collateral is scheduled for renewal
+    // before it expires; the renewed collateral replaces the cached one only
+    // if it verifies the same attestation.
+    RAVL_VISIBILITY void cache_collateral(
+      const CollateralKey& key,
+      const std::shared_ptr<const QL_QVE_Collateral>& collateral,
+      const Options& options,
+      const std::vector<uint8_t>& evidence,
+      std::shared_ptr<const HTTPResponses> responses,
+      bool store)
+    {
+      try
+      {
+        auto expiry = collateral_expiry(*collateral);
+        auto previous = collateral_cache().find(key);
+        collateral_cache().insert(key, collateral, expiry);
+
+        if (
+          !previous || (*previous)->tcb_info != collateral->tcb_info ||
+          (*previous)->pck_crl != collateral->pck_crl ||
+          (*previous)->root_ca_crl != collateral->root_ca_crl)
+          verdict_cache().invalidate(platform_id(key));
+
+        if (store && options.endorsement_store_path)
+        {
+          auto requests =
+            download_collateral(key.ca_type, key.fmspc, options, key.qve);
+          EndorsementStore::get(*options.endorsement_store_path)
+            ->insert(requests, *responses, expiry);
+        }
+
+        auto renewal_options = options;
+        renewal_options.verbosity = 0;
+        renewal_options.fresh_endorsements = false;
+        renewal_options.fresh_root_ca_certificate = false;
+
+        auto attestation =
+          std::make_shared<const Attestation>(evidence, std::vector<uint8_t>());
+
+        endorsement_refresh_schedule().schedule(
+          fmt::format(
+            "sgx:{}:{}{}:{}",
+            key.fmspc,
+            key.ca_type,
+            key.qve ? ":qve" : "",
+            key.source),
+          expiry,
+          [key, renewal_options]() {
+            return download_collateral(
+              key.ca_type, key.fmspc, renewal_options, key.qve);
+          },
+          [attestation, renewal_options](HTTPResponses&& renewed) {
+            attestation->verify(renewal_options, renewed);
+          },
+          std::move(responses));
+      }
+      catch (const std::exception& ex)
+      {
+        if (options.verbosity > 0)
+          log(fmt::format("- collateral not cached: {}", ex.what()), 2);
+      }
+    }
+
+    struct CachedCollateral
+    {
+      std::shared_ptr<const QL_QVE_Collateral> collateral = nullptr;
+
+      /// Responses that the collateral was made from, if it was loaded from
+      /// the endorsement store (and is not cached in-process yet)
+      std::shared_ptr<const HTTPResponses> stored_responses = nullptr;
+    };
+
+    RAVL_VISIBILITY CachedCollateral
+    find_stored_collateral(const CollateralKey& key, const Options& options)
+    {
+      if (!options.endorsement_store_path)
+        return {};
+
+      try
+      {
+        auto requests =
+          download_collateral(key.ca_type, key.fmspc, options, key.qve);
+        auto store = EndorsementStore::get(*options.endorsement_store_path);
+        auto responses = store->find(requests);
+        if (!responses)
+          return {};
+
+        return {
+          consume_url_responses(options, *responses, nullptr, key.qve),
+          std::make_shared<const HTTPResponses>(std::move(*responses))};
+      }
+      catch (const std::exception& ex)
+      {
+        if (options.verbosity > 0)
+          log(fmt::format("- stored collateral not used: {}", ex.what()), 2);
+        return {};
+      }
+    }
+
+    RAVL_VISIBILITY CachedCollateral
+    find_cached_collateral(const CollateralKey& key, const Options& options)
+    {
+      if (
+        !options.cache_endorsements || options.fresh_endorsements ||
+        options.fresh_root_ca_certificate)
+        return {};
+
+      auto cached = collateral_cache().find(key);
+      auto r = cached ? CachedCollateral{*cached} :
+                        find_stored_collateral(key, options);
+      if (!r.collateral)
+        return {};
+
+      // Collateral cached without a root CA certificate (because one was
+      // provided in the options at the time) is only good for requests that
+      // come with their own root CA certificate.
+      if (r.collateral->root_ca.empty() && !options.root_ca_certificate)
+        return {};
+
+      return r;
+    }
+
     class CertificateExtension
     {
     public:
@@ -618,12 +819,65 @@ namespace ravl
       std::vector<std::string> advisory_ids = {};
     };
 
-    RAVL_VISIBILITY TCBLevel verify_tcb_json(
-      const std::string& tcb_info,
-      const CertificateExtension& pck_ext,
-      crypto::UqEVP_PKEY& signer_pubkey)
+    // TCB info with its TCB levels in a compact table, parsed and
+    // signature-checked once.
+    struct TcbInfoIndex
     {
-      TCBLevel platform_tcb_level = {};
+      struct Level
+      {
+        std::array<uint8_t, 16> comp_svn;
+        uint16_t pce_svn;
+        uint16_t status; // Index into `statuses`
+      };
+
+      std::vector<uint8_t> fmspc;
+      std::vector<uint8_t> pce_id;
+      std::vector<Level> levels;
+      std::vector<std::string> dates; // One per level
+      std::vector<std::string> statuses;
+
+      TCBLevel match(const CertificateExtension& pck_ext) const
+      {
+        if (fmspc != pck_ext.fmspc)
+          throw std::runtime_error(
+            "incorrectly formatted SGX TCB: fmspc mismatch");
+
+        if (pce_id != pck_ext.pceid)
+          throw std::runtime_error(
+            "incorrectly formatted SGX TCB: pceid mismatch");
+
+        const auto& comp_svn = pck_ext.tcb.comp_svn;
+        const auto pce_svn = pck_ext.tcb.pce_svn;
+
+        // See
+        // https://github.com/openenclave/openenclave/blob/master/common/sgx/tcbinfo.c#L398
+        // "Choose the first tcb level for which all of the platform's
+        // comp svn values and pcesvn values are greater than or equal to
+        // corresponding values of the tcb level."
+        for (size_t i = 0; i < levels.size(); i++)
+        {
+          const auto& level = levels[i];
+          bool good = pce_svn >= level.pce_svn;
+          for (size_t j = 0; j < comp_svn.size(); j++)
+            good &= comp_svn[j] >= level.comp_svn[j];
+          if (good)
+            return {
+              level.comp_svn,
+              level.pce_svn,
+              statuses[level.status],
+              dates[i],
+              std::vector<std::string>()};
+        }
+
+        throw std::runtime_error(
+          "incorrectly formatted SGX TCB: no matching TCB level found");
+      }
+    };
+
+    RAVL_VISIBILITY TcbInfoIndex parse_tcb_info(
+      const std::string& tcb_info, crypto::UqEVP_PKEY& signer_pubkey)
+    {
+      TcbInfoIndex r;
 
       std::vector<uint8_t> signature;
 
@@ -647,61 +901,42 @@ namespace ravl
 
         // TODO: advisory IDs?
 
-        if (!json_vector_eq(tcbinfo_j, "fmspc", pck_ext.fmspc))
-          throw std::runtime_error("fmspc mismatch");
-
-        if (!json_vector_eq(tcbinfo_j, "pceId", pck_ext.pceid))
-          throw std::runtime_error("pceid mismatch");
+        r.fmspc = from_hex(tcbinfo_j["fmspc"].get<std::string>());
+        r.pce_id = from_hex(tcbinfo_j["pceId"].get<std::string>());
 
         uint64_t tcb_type = tcbinfo_j["tcbType"].get<uint64_t>();
         if (tcb_type != 0)
           throw std::runtime_error("tcbType not supported");
 
+        static const auto svn_names = []() {
+          std::array<std::string, 16> names;
+          for (size_t i = 0; i < names.size(); i++)
+            names[i] = fmt::format("sgxtcbcomp{:02d}svn", i + 1);
+          return names;
+        }();
+
         for (const auto& tcb_level_j : tcbinfo_j["tcbLevels"])
         {
           std::string tcb_date = tcb_level_j["tcbDate"].get<std::string>();
           std::string tcb_status = tcb_level_j["tcbStatus"].get<std::string>();
           const auto& tcb = tcb_level_j["tcb"];
 
-          size_t comp_svn_size = pck_ext.tcb.comp_svn.size();
-          if (comp_svn_size != 16)
-            throw std::runtime_error("unexpected comp_svn size");
-
-          std::array<uint8_t, 16> tcb_level_comp_svn;
-          for (size_t i = 0; i < comp_svn_size; i++)
-          {
-            std::string svn_name = fmt::format("sgxtcbcomp{:02d}svn", i + 1);
-            tcb_level_comp_svn[i] = tcb[svn_name].get<uint8_t>();
-          }
-          uint16_t tcb_level_pce_svn = tcb["pcesvn"].get<uint16_t>();
+          TcbInfoIndex::Level level;
+          for (size_t i = 0; i < level.comp_svn.size(); i++)
+            level.comp_svn[i] = tcb[svn_names[i]].get<uint8_t>();
+          level.pce_svn = tcb["pcesvn"].get<uint16_t>();
 
           // optional advisoryIDs?
 
-          if (platform_tcb_level.status.empty())
-          {
-            // See
-            // https://github.com/openenclave/openenclave/blob/master/common/sgx/tcbinfo.c#L398
-            // "Choose the first tcb level for which all of the platform's
-            // comp svn values and pcesvn values are greater than or equal to
-            // corresponding values of the tcb level."
-            bool good = true;
-            for (size_t i = 0; i < comp_svn_size && good; i++)
-              good = good && pck_ext.tcb.comp_svn[i] >= tcb_level_comp_svn[i];
-            good = good && pck_ext.tcb.pce_svn >= tcb_level_pce_svn;
-            if (good)
-            {
-              platform_tcb_level = {
-                tcb_level_comp_svn,
-                tcb_level_pce_svn,
-                tcb_status,
-                tcb_date,
-                std::vector<std::string>()};
-            }
-          }
-        }
+          auto sit =
+            std::find(r.statuses.begin(), r.statuses.end(), tcb_status);
+          level.status = sit - r.statuses.begin();
+          if (sit == r.statuses.end())
+            r.statuses.push_back(tcb_status);
 
-        if (platform_tcb_level.status.empty())
-          throw std::runtime_error("no matching TCB level found");
+          r.levels.push_back(level);
+          r.dates.push_back(tcb_date);
+        }
 
         auto sig_j = col_tcb_info_j["signature"];
         signature = from_hex(sig_j.get<std::string>());
@@ -721,25 +956,68 @@ namespace ravl
       static const std::string post = ",\"signature\"";
 
       auto l = tcb_info_s.find(pre);
-      auto r = tcb_info_s.rfind(post);
-      if (l == std::string::npos || r == std::string::npos)
+      auto rp = tcb_info_s.rfind(post);
+      if (l == std::string::npos || rp == std::string::npos)
         throw std::runtime_error("tcbInfo does not contain signature");
 
       std::span signed_msg = {
         (uint8_t*)tcb_info_s.data() + l + pre.size(),
-        (uint8_t*)tcb_info_s.data() + r};
+        (uint8_t*)tcb_info_s.data() + rp};
 
       if (!verify_signature(signer_pubkey, signed_msg, signature))
         throw std::runtime_error("tcbInfo signature verification failed");
 
-      return platform_tcb_level;
+      return r;
+    }
+
+    RAVL_VISIBILITY TCBLevel verify_tcb_json(
+      const std::string& tcb_info,
+      const CertificateExtension& pck_ext,
+      crypto::UqEVP_PKEY& signer_pubkey)
+    {
+      return parse_tcb_info(tcb_info, signer_pubkey).match(pck_ext);
+    }
+
+    static constexpr size_t tcb_info_cache_max_entries = 256;
+
+    using TcbInfoCache =
+      ExpiringCache<std::string, std::shared_ptr<const TcbInfoIndex>>;
+
+    RAVL_VISIBILITY TcbInfoCache& tcb_info_cache()
+    {
+      static TcbInfoCache cache(tcb_info_cache_max_entries);
+      return cache;
+    }
+
+    RAVL_VISIBILITY std::shared_ptr<const crypto::TrustStore> get_trust_store(
+      const QL_QVE_Collateral& collateral)
+    {
+      using namespace crypto;
+
+      // Without a root CA certificate, the root of the PCK CRL issuer chain is
+      // auto-trusted.
+      bool trusted_root = collateral.root_ca.empty();
+      auto key = trust_store_key(
+        {trusted_root ? "chain" : "root",
+         trusted_root ? collateral.pck_crl_issuer_chain : collateral.root_ca,
+         collateral.root_ca_crl,
+         collateral.pck_crl});
+
+      return crypto::get_trust_store(key, [&collateral](UqX509_STORE& store) {
+        store.add_crl(collateral.root_ca_crl);
+        store.add_crl(collateral.pck_crl);
+        if (!collateral.root_ca.empty())
+          store.add(collateral.root_ca);
+        else
+          store.add(UqStackOfX509(collateral.pck_crl_issuer_chain).back());
+      });
     }
 
     RAVL_VISIBILITY TCBLevel verify_tcb(
       const std::string& tcb_info_issuer_chain,
       const std::string& tcb_info,
       const CertificateExtension& pck_ext,
-      crypto::UqX509_STORE& store,
+      const crypto::TrustStore& trust_store,
       const Options& options,
       size_t indent = 0)
     {
@@ -752,17 +1030,14 @@ namespace ravl
       }
       auto tcb_issuer_chain = verify_certificate_chain(
         tcb_info_issuer_chain,
-        store,
+        trust_store,
         options.certificate_verification,
-        false,
         options.verbosity,
         indent + 4);
 
       auto tcb_issuer_leaf = tcb_issuer_chain.front();
       auto tcb_issuer_root = tcb_issuer_chain.back();
 
-      UqEVP_PKEY tcb_issuer_leaf_pubkey(tcb_issuer_leaf);
-
       if (
         options.check_root_certificate_manufacturer_key &&
         !tcb_issuer_root.has_public_key(intel_root_public_key_pem))
@@ -770,48 +1045,99 @@ namespace ravl
           "TCB issuer root certificate does not use the expected Intel SGX "
           "public key");
 
-      return verify_tcb_json(tcb_info, pck_ext, tcb_issuer_leaf_pubkey);
+      // The index is only valid for TCB info signed by this issuer.
+      auto key = fmt::format(
+        "{:02x}:{}",
+        fmt::join(pck_ext.fmspc, ""),
+        trust_store_key({tcb_info_issuer_chain, tcb_info}));
+
+      auto cached = tcb_info_cache().find(key);
+      if (cached)
+        return (*cached)->match(pck_ext);
+
+      UqEVP_PKEY tcb_issuer_leaf_pubkey(tcb_issuer_leaf);
+      auto index = std::make_shared<const TcbInfoIndex>(
+        parse_tcb_info(tcb_info, tcb_issuer_leaf_pubkey));
+      tcb_info_cache().insert(
+        key, index, std::chrono::system_clock::time_point::max());
+      return index->match(pck_ext);
     }
 
-    RAVL_VISIBILITY bool verify_qe_id(
-      const std::string& qe_identity_issuer_chain,
-      const std::string& qe_identity,
-      const std::span<const uint8_t>& qe_report_body_s,
-      crypto::UqX509_STORE& store,
-      const Options& options,
-      size_t indent = 0)
+    // QE identity, parsed and signature-checked once.
+    struct QeIdentityIndex
     {
-      using namespace crypto;
-
-      const sgx_report_body_t& qe_report_body =
-        *(sgx_report_body_t*)qe_report_body_s.data();
+      struct Level
+      {
+        uint16_t isv_svn;
+        uint16_t status; // Index into `statuses`
+      };
 
-      if (options.verbosity > 0)
+      std::vector<uint8_t> mrsigner;
+      uint16_t isv_prod_id = 0;
+      uint32_t misc_select = 0;
+      uint32_t misc_select_mask = 0;
+      uint64_t flags = 0;
+      uint64_t flags_mask = 0;
+      uint64_t xfrm = 0;
+      uint64_t xfrm_mask = 0;
+      std::vector<Level> levels;
+      std::vector<std::string> statuses;
+
+      void match(
+        const sgx_report_body_t& qe_report_body, const Options& options) const
       {
-        log("- QE identity verification", indent);
-        log("- QE identity issuer certificate chain verification", indent + 2);
+        try
+        {
+          // See
+          // https://github.com/openenclave/openenclave/blob/master/common/sgx/tcbinfo.c#L1023
+          // "Choose the first tcb level for which all of the platform's isv
+          // svn values are greater than or equal to corresponding values of
+          // the tcb level."
+          auto lit = std::find_if(
+            levels.begin(), levels.end(), [&qe_report_body](const Level& l) {
+              return qe_report_body.isv_svn >= l.isv_svn;
+            });
+
+          if (lit == levels.end())
+            throw std::runtime_error("no matching QE TCB level found");
+
+          if (!std::equal(
+                mrsigner.begin(),
+                mrsigner.end(),
+                std::begin(qe_report_body.mr_signer.m),
+                std::end(qe_report_body.mr_signer.m)))
+            throw std::runtime_error("QE mrsigner mismatch");
+
+          if (isv_prod_id != qe_report_body.isv_prod_id)
+            throw std::runtime_error("QE isv prod id mismatch");
+
+          if (!options.historical && lit->isv_svn >= qe_report_body.isv_svn)
+            throw std::runtime_error("QE isv svn too small");
+
+          if ((qe_report_body.misc_select & misc_select_mask) != misc_select)
+            throw std::runtime_error("misc select mismatch");
+
+          if ((qe_report_body.attributes.flags & flags_mask) != flags)
+            throw std::runtime_error("attribute flags mismatch");
+
+          if ((qe_report_body.attributes.xfrm & xfrm_mask) != xfrm)
+            throw std::runtime_error("attribute xfrm mismatch");
+
+          if (qe_report_body.attributes.flags & SGX_FLAGS_DEBUG)
+            throw std::runtime_error("report purported to be from debug QE");
+        }
+        catch (const std::exception& ex)
+        {
+          throw std::runtime_error(
+            std::string("incorrectly formatted SGX QE ID: ") + ex.what());
+        }
       }
-      auto qe_id_issuer_chain = verify_certificate_chain(
-        qe_identity_issuer_chain,
-        store,
-        options.certificate_verification,
-        false,
-        options.verbosity,
-        indent + 4);
-
-      auto qe_id_issuer_leaf = qe_id_issuer_chain.at(0);
-      auto qe_id_issuer_root =
-        qe_id_issuer_chain.at(qe_id_issuer_chain.size() - 1);
-
-      UqEVP_PKEY qe_id_issuer_leaf_pubkey(qe_id_issuer_leaf);
+    };
 
-      if (
-        options.check_root_certificate_manufacturer_key &&
-        !qe_id_issuer_root.has_public_key(intel_root_public_key_pem))
-        throw std::runtime_error(
-          "QE identity issuer root certificate does not use the expected "
-          "Intel "
-          "SGX public key");
+    RAVL_VISIBILITY QeIdentityIndex parse_qe_identity(
+      const std::string& qe_identity, crypto::UqEVP_PKEY& signer_pubkey)
+    {
+      QeIdentityIndex r;
 
       std::string qe_identity_s = {
         (char*)qe_identity.data(), qe_identity.size()};
@@ -819,10 +1145,6 @@ namespace ravl
 
       try
       {
-        std::string qe_tcb_level_status = "";
-        std::string qe_tcb_date = "";
-        uint16_t qe_tcb_level_isv_svn = 0;
-
         auto qe_id_j = ravl::json::parse(qe_identity_s);
         auto enclave_identity = qe_id_j["enclaveIdentity"];
 
@@ -837,60 +1159,34 @@ namespace ravl
         for (const auto& tcb_level : enclave_identity["tcbLevels"])
         {
           auto tcb_j = tcb_level["tcb"];
-          uint16_t tcb_level_isv_svn = tcb_j["isvsvn"].get<uint16_t>();
-          auto tcb_date = tcb_level["tcbDate"];
           auto tcb_status = tcb_level["tcbStatus"].get<std::string>();
 
-          if (qe_tcb_level_status.empty())
-          {
-            // See
-            // https://github.com/openenclave/openenclave/blob/master/common/sgx/tcbinfo.c#L1023
-            // "Choose the first tcb level for which all of the platform's isv
-            // svn values are greater than or equal to corresponding values of
-            // the tcb level."
-            if (qe_report_body.isv_svn >= tcb_level_isv_svn)
-            {
-              qe_tcb_level_status = tcb_status;
-              qe_tcb_date = tcb_date;
-              qe_tcb_level_isv_svn = tcb_level_isv_svn;
-
-              // TODO: optional advisories?
-            }
-          }
-        }
+          QeIdentityIndex::Level level;
+          level.isv_svn = tcb_j["isvsvn"].get<uint16_t>();
 
-        if (qe_tcb_level_status.empty())
-          throw std::runtime_error("no matching QE TCB level found");
+          // TODO: optional advisories?
+
+          auto sit =
+            std::find(r.statuses.begin(), r.statuses.end(), tcb_status);
+          level.status = sit - r.statuses.begin();
+          if (sit == r.statuses.end())
+            r.statuses.push_back(tcb_status);
+
+          r.levels.push_back(level);
+        }
 
         auto id = enclave_identity["issueDate"].get<std::string>();
         check_datetime(id, "QE TCB issue date");
         auto nu = enclave_identity["nextUpdate"].get<std::string>();
         check_datetime(nu, "QE TCB next update");
 
-        std::vector<uint8_t> reported_mrsigner = {
-          &qe_report_body.mr_signer.m[0],
-          &qe_report_body.mr_signer.m[0] + sizeof(qe_report_body.mr_signer.m)};
-
-        if (
-          from_hex(enclave_identity["mrsigner"].get<std::string>()) !=
-          reported_mrsigner)
-          throw std::runtime_error("QE mrsigner mismatch");
-
-        if (
-          enclave_identity["isvprodid"].get<uint16_t>() !=
-          qe_report_body.isv_prod_id)
-          throw std::runtime_error("QE isv prod id mismatch");
-
-        if (
-          !options.historical && qe_tcb_level_isv_svn >= qe_report_body.isv_svn)
-          throw std::runtime_error("QE isv svn too small");
+        r.mrsigner = from_hex(enclave_identity["mrsigner"].get<std::string>());
+        r.isv_prod_id = enclave_identity["isvprodid"].get<uint16_t>();
 
-        uint32_t msel_mask = from_hex_t<uint32_t>(
+        r.misc_select_mask = from_hex_t<uint32_t>(
           enclave_identity["miscselectMask"].get<std::string>());
-        uint32_t msel = from_hex_t<uint32_t>(
+        r.misc_select = from_hex_t<uint32_t>(
           enclave_identity["miscselect"].get<std::string>());
-        if ((qe_report_body.misc_select & msel_mask) != msel)
-          throw std::runtime_error("misc select mismatch");
 
         auto attribute_flags_xfrm_s =
           enclave_identity["attributes"].get<std::string>();
@@ -902,24 +1198,12 @@ namespace ravl
           attribute_flags_xfrm_mask_s.size() != 32)
           throw std::runtime_error("unexpected attribute value sizes");
 
-        auto flags_s = attribute_flags_xfrm_s.substr(0, 16);
-        auto xfrm_s = attribute_flags_xfrm_s.substr(16);
-        auto flags_mask_s = attribute_flags_xfrm_mask_s.substr(0, 16);
-        auto xfrm_mask_s = attribute_flags_xfrm_mask_s.substr(16);
-
-        uint64_t flags = from_hex_t<uint64_t>(flags_s);
-        uint64_t xfrm = from_hex_t<uint64_t>(xfrm_s);
-        uint64_t flags_mask = from_hex_t<uint64_t>(flags_mask_s);
-        uint64_t xfrm_mask = from_hex_t<uint64_t>(xfrm_mask_s);
-
-        if ((qe_report_body.attributes.flags & flags_mask) != flags)
-          throw std::runtime_error("attribute flags mismatch");
-
-        if ((qe_report_body.attributes.xfrm & xfrm_mask) != xfrm)
-          throw std::runtime_error("attribute xfrm mismatch");
-
-        if (qe_report_body.attributes.flags & SGX_FLAGS_DEBUG)
-          throw std::runtime_error("report purported to be from debug QE");
+        r.flags = from_hex_t<uint64_t>(attribute_flags_xfrm_s.substr(0, 16));
+        r.xfrm = from_hex_t<uint64_t>(attribute_flags_xfrm_s.substr(16));
+        r.flags_mask =
+          from_hex_t<uint64_t>(attribute_flags_xfrm_mask_s.substr(0, 16));
+        r.xfrm_mask =
+          from_hex_t<uint64_t>(attribute_flags_xfrm_mask_s.substr(16));
 
         auto sig_j = qe_id_j["signature"];
         signature = from_hex(sig_j.get<std::string>());
@@ -939,17 +1223,85 @@ namespace ravl
       static const std::string& post = ",\"signature\":\"";
 
       auto l = qe_identity_s.find(pre);
-      auto r = qe_identity_s.rfind(post);
-      if (l == std::string::npos || r == std::string::npos)
+      auto rp = qe_identity_s.rfind(post);
+      if (l == std::string::npos || rp == std::string::npos)
         throw std::runtime_error("QE identity does not contain signature");
 
       std::span signed_msg = {
         (uint8_t*)qe_identity_s.data() + l + pre.size(),
-        (uint8_t*)qe_identity_s.data() + r};
+        (uint8_t*)qe_identity_s.data() + rp};
 
-      if (!verify_signature(qe_id_issuer_leaf_pubkey, signed_msg, signature))
+      if (!verify_signature(signer_pubkey, signed_msg, signature))
         throw std::runtime_error("QE identity signature verification failed");
 
+      return r;
+    }
+
+    static constexpr size_t qe_identity_cache_max_entries = 16;
+
+    using QeIdentityCache =
+      ExpiringCache<std::string, std::shared_ptr<const QeIdentityIndex>>;
+
+    RAVL_VISIBILITY QeIdentityCache& qe_identity_cache()
+    {
+      static QeIdentityCache cache(qe_identity_cache_max_entries);
+      return cache;
+    }
+
+    RAVL_VISIBILITY bool verify_qe_id(
+      const std::string& qe_identity_issuer_chain,
+      const std::string& qe_identity,
+      const std::span<const uint8_t>& qe_report_body_s,
+      const crypto::TrustStore& trust_store,
+      const Options& options,
+      size_t indent = 0)
+    {
+      using namespace crypto;
+
+      const sgx_report_body_t& qe_report_body =
+        *(sgx_report_body_t*)qe_report_body_s.data();
+
+      if (options.verbosity > 0)
+      {
+        log("- QE identity verification", indent);
+        log("- QE identity issuer certificate chain verification", indent + 2);
+      }
+      auto qe_id_issuer_chain = verify_certificate_chain(
+        qe_identity_issuer_chain,
+        trust_store,
+        options.certificate_verification,
+        options.verbosity,
+        indent + 4);
+
+      auto qe_id_issuer_leaf = qe_id_issuer_chain.at(0);
+      auto qe_id_issuer_root =
+        qe_id_issuer_chain.at(qe_id_issuer_chain.size() - 1);
+
+      if (
+        options.check_root_certificate_manufacturer_key &&
+        !qe_id_issuer_root.has_public_key(intel_root_public_key_pem))
+        throw std::runtime_error(
+          "QE identity issuer root certificate does not use the expected "
+          "Intel "
+          "SGX public key");
+
+      // The parsed identity is only valid for QE identities signed by this
+      // issuer.
+      auto key = trust_store_key({qe_identity_issuer_chain, qe_identity});
+
+      auto cached = qe_identity_cache().find(key);
+      if (cached)
+      {
+        (*cached)->match(qe_report_body, options);
+        return true;
+      }
+
+      UqEVP_PKEY qe_id_issuer_leaf_pubkey(qe_id_issuer_leaf);
+      auto index = std::make_shared<const QeIdentityIndex>(
+        parse_qe_identity(qe_identity, qe_id_issuer_leaf_pubkey));
+      qe_identity_cache().insert(
+        key, index, std::chrono::system_clock::time_point::max());
+      index->match(qe_report_body, options);
       return true;
     }
 
@@ -1111,6 +1463,42 @@ namespace ravl
       }
     };
 
+    RAVL_VISIBILITY CollateralKey
+    collateral_key(const SignatureData& signature_data, bool qve = false)
+    {
+      // Get X509 extensions from the PCK cert to find CA type and fmspc.
+      // The cert chain is still unverified at this point.
+      using namespace crypto;
+
+      auto pck_pem = extract_pem_certificate(signature_data.certification_data);
+      UqX509 pck_leaf(UqBIO(pck_pem), true);
+      CertificateExtension pck_ext(pck_leaf);
+
+      bool have_pid = pck_ext.platform_instance_id &&
+        !is_all_zero(*pck_ext.platform_instance_id);
+
+      return CollateralKey{
+        .fmspc = fmt::format("{:02x}", fmt::join(pck_ext.fmspc, "")),
+        .ca_type = have_pid ? "platform" : "processor",
+        .qve = qve,
+        .source = ""};
+    }
+
+    RAVL_VISIBILITY CollateralKey collateral_key(
+      const SignatureData& signature_data, const Options& options)
+    {
+      auto r = collateral_key(signature_data);
+      r.source = collateral_source(r, options);
+      return r;
+    }
+
+    RAVL_VISIBILITY std::string Attestation::platform_id() const
+    {
+      std::span quote = parse_quote(*this);
+      SignatureData signature_data(quote, *this);
+      return sgx::platform_id(collateral_key(signature_data));
+    }
+
     RAVL_VISIBILITY std::optional<HTTPRequests> Attestation::
       prepare_endorsements(const Options& options) const
     {
@@ -1132,20 +1520,10 @@ namespace ravl
       }
       else
       {
-        // Get X509 extensions from the PCK cert to find CA type and fmspc.
-        // The cert chain is still unverified at this point.
-        using namespace crypto;
-
-        auto pck_pem =
-          extract_pem_certificate(signature_data.certification_data);
-        UqX509 pck_leaf(UqBIO(pck_pem), true);
-        CertificateExtension pck_ext(pck_leaf);
-
-        bool have_pid = pck_ext.platform_instance_id &&
-          !is_all_zero(*pck_ext.platform_instance_id);
-        auto ca_type = have_pid ? "platform" : "processor";
-        auto fmspc_hex = fmt::format("{:02x}", fmt::join(pck_ext.fmspc, ""));
-        r = download_collateral(ca_type, fmspc_hex, options, false);
+        auto key = collateral_key(signature_data, options);
+        if (find_cached_collateral(key, options).collateral)
+          return std::nullopt;
+        r = download_collateral(key.ca_type, key.fmspc, options, key.qve);
       }
 
       return r;
@@ -1295,52 +1673,65 @@ namespace ravl
       if (options.partial)
         return partial_verify(options);
 
-      if (
-        this->endorsements.empty() &&
-        (!http_responses || http_responses->empty()))
-        throw std::runtime_error("missing endorsements");
-
       size_t indent = 0;
 
-      UqX509_STORE store;
+      std::span quote = parse_quote(*this);
+      SignatureData signature_data(quote, *this);
+
+      std::shared_ptr<const QL_QVE_Collateral> collateral;
 
-      std::shared_ptr<QL_QVE_Collateral> collateral;
+      // Downloaded or stored collateral is cached once verification succeeds.
+      std::optional<CollateralKey> cache_key = std::nullopt;
+      std::shared_ptr<const HTTPResponses> cache_responses = nullptr;
+      bool downloaded = false;
 
       if (!this->endorsements.empty())
         collateral = std::make_shared<QL_QVE_Collateral>(this->endorsements);
 
       if (http_responses && !http_responses->empty())
+      {
+        if (
+          options.cache_endorsements &&
+          (this->endorsements.empty() || options.fresh_endorsements))
+        {
+          cache_key = collateral_key(signature_data, options);
+          cache_responses =
+            std::make_shared<const HTTPResponses>(*http_responses);
+          downloaded = true;
+        }
         collateral =
-          consume_url_responses(options, *http_responses, collateral);
+          consume_url_responses(options, *http_responses, collateral, false);
+      }
+      else if (!collateral)
+      {
+        auto key = collateral_key(signature_data, options);
+        auto cached = find_cached_collateral(key, options);
+        collateral = cached.collateral;
+        if (cached.stored_responses)
+        {
+          cache_key = key;
+          cache_responses = cached.stored_responses;
+        }
+      }
 
-      std::span quote = parse_quote(*this);
-      SignatureData signature_data(quote, *this);
+      if (!collateral)
+        throw std::runtime_error("missing endorsements");
 
       if (options.verbosity > 0)
         log(collateral->to_string(options.verbosity, indent + 2), indent);
 
-      // These flags also check that we have a CRL for each CA.
-      store.set_flags(X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
-      store.add_crl(collateral->root_ca_crl);
-      store.add_crl(collateral->pck_crl);
-
-      bool trusted_root = false;
-
-      if (!collateral->root_ca.empty())
-        store.add(collateral->root_ca);
-      else
-        trusted_root = true;
-
       // Validate PCK certificate and it's issuer chain. We trust the root CA
       // certificate in the endorsements if no other one is provided, but
       // check that it has Intel's public key afterwards.
+      bool trusted_root = collateral->root_ca.empty();
+      auto trust_store = get_trust_store(*collateral);
+
       if (options.verbosity > 0)
         log("- PCK CRL issuer certificate chain verification", indent + 2);
       auto pck_crl_issuer_chain = verify_certificate_chain(
         collateral->pck_crl_issuer_chain,
-        store,
+        *trust_store,
         options.certificate_verification,
-        trusted_root,
         options.verbosity,
         indent + 4);
 
@@ -1375,7 +1766,7 @@ namespace ravl
         log("- PCK certificate chain verification", indent + 2);
       auto pck_cert_chain = verify_certificate_chain(
         signature_data.certification_data,
-        store,
+        trust_store->get(),
         options.certificate_verification,
         false,
         options.verbosity,
@@ -1425,7 +1816,7 @@ namespace ravl
         collateral->tcb_info_issuer_chain,
         collateral->tcb_info,
         pck_x509_ext,
-        store,
+        *trust_store,
         options,
         indent + 2);
 
@@ -1434,13 +1825,22 @@ namespace ravl
         collateral->qe_identity_issuer_chain,
         collateral->qe_identity,
         signature_data.report,
-        store,
+        *trust_store,
         options,
         indent + 2);
 
       if (!(qe_sig_ok && pk_auth_hash_matches && quote_sig_ok && qe_id_ok))
         std::runtime_error("one of the basic properties is not satisfied");
 
+      if (cache_key)
+        cache_collateral(
+          *cache_key,
+          collateral,
+          options,
+          this->evidence,
+          std::move(cache_responses),
+          downloaded);
+
       return make_claims(
         *(const sgx_quote_t*)quote.data(), signature_data, *collateral);
     }
@@ -0,0 +1,215 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace ravl
+{
+  /// Thread-safe table of shared objects, indexed by generation-tagged keys.
+  ///
+  /// Objects live in slots that are allocated in chunks and never move, so
+  /// lookups and removals only lock the slot they touch. Slots are handed out
+  /// by a number of shards (one per thread, modulo the number of shards), each
+  /// with its own free list. Keys combine the shard, the slot index and a
+  /// per-slot generation, so keys of removed objects never match objects that
+  /// reuse their slot.
+  template <typename T>
+  class ShardedSlotMap
+  {
+  public:
+    typedef uint64_t Key;
+
+    static constexpr size_t num_shards = 16;
+    static constexpr size_t chunk_size = 4096;
+    static constexpr size_t max_chunks = 1024;
+
+    ShardedSlotMap() = default;
+    ShardedSlotMap(const ShardedSlotMap&) = delete;
+    ShardedSlotMap& operator=(const ShardedSlotMap&) = delete;
+    virtual ~ShardedSlotMap() = default;
+
+    /// Construct an object in a free slot and return its key.
+    template <typename... Args>
+    Key emplace(Args&&... args)
+    {
+      auto node = std::make_shared<Node>(std::forward<Args>(args)...);
+
+      auto shard_index = this_shard();
+      auto& shard = shards[shard_index];
+      Slot* slot = nullptr;
+      uint32_t index = 0;
+
+      {
+        std::lock_guard<std::mutex> guard(shard.mtx);
+        if (!shard.free.empty())
+        {
+          index = shard.free.back();
+          shard.free.pop_back();
+        }
+        else
+        {
+          if (shard.used == chunk_size * max_chunks)
+            throw std::bad_alloc();
+          index = shard.used++;
+          auto& chunk = shard.chunks[index / chunk_size];
+          if (!chunk.load(std::memory_order_relaxed))
+            chunk.store(new Chunk(), std::memory_order_release);
+        }
+        slot = &shard.slot(index);
+        node->key = make_key(++slot->generation, shard_index, index);
+      }
+
+      SlotGuard guard(*slot);
+      slot->node = std::move(node);
+      return slot->node->key;
+    }
+
+    /// Find an object (nullptr if there is none with this key).
+    std::shared_ptr<T> find(Key key) const
+    {
+      Slot* slot = find_slot(key);
+      if (!slot)
+        return nullptr;
+
+      SlotGuard guard(*slot);
+      if (!slot->node || slot->node->key != key)
+        return nullptr;
+      return std::shared_ptr<T>(slot->node, &slot->node->value);
+    }
+
+    /// Remove an object; returns false if there is none with this key. The
+    /// object is destroyed when the last reference obtained via find() is
+    /// released.
+    bool erase(Key key)
+    {
+      Slot* slot = find_slot(key);
+      if (!slot)
+        return false;
+
+      std::shared_ptr<Node> node;
+      {
+        SlotGuard guard(*slot);
+        if (!slot->node || slot->node->key != key)
+          return false;
+        node.swap(slot->node);
+      }
+
+      auto& shard = shards[shard_of(key)];
+      std::lock_guard<std::mutex> guard(shard.mtx);
+      shard.free.push_back(index_of(key));
+      return true;
+    }
+
+  protected:
+    struct Node
+    {
+      template <typename... Args>
+      Node(Args&&... args) : value(std::forward<Args>(args)...)
+      {}
+
+      Key key = 0;
+      T value;
+    };
+
+    struct Slot
+    {
+      std::atomic_flag busy = ATOMIC_FLAG_INIT;
+      uint32_t generation = 0;
+      std::shared_ptr<Node> node = nullptr;
+    };
+
+    // Slots are locked only for as long as it takes to copy or swap a
+    // shared_ptr, so spinning is cheaper than a mutex per slot.
+    struct SlotGuard
+    {
+      Slot& slot;
+
+      SlotGuard(Slot& slot_) : slot(slot_)
+      {
+        while (slot.busy.test_and_set(std::memory_order_acquire))
+          std::this_thread::yield();
+      }
+
+      ~SlotGuard()
+      {
+        slot.busy.clear(std::memory_order_release);
+      }
+    };
+
+    struct Chunk
+    {
+      std::array<Slot, chunk_size> slots;
+    };
+
+    struct Shard
+    {
+      std::mutex mtx;
+      std::vector<uint32_t> free;
+      size_t used = 0;
+      std::array<std::atomic<Chunk*>, max_chunks> chunks = {};
+
+      ~Shard()
+      {
+        for (auto& c : chunks)
+          delete c.load();
+      }
+
+      Slot& slot(uint32_t index)
+      {
+        return chunks[index / chunk_size].load(std::memory_order_acquire)
+          ->slots[index % chunk_size];
+      }
+    };
+
+    // Keys: generation (32 bits), shard (8 bits), slot index (24 bits)
+    static_assert(num_shards <= (1 << 8));
+    static_assert(chunk_size * max_chunks <= (1 << 24));
+
+    std::array<Shard, num_shards> shards;
+
+    static Key make_key(uint32_t generation, size_t shard, uint32_t index)
+    {
+      return (Key)generation << 32 | (Key)shard << 24 | index;
+    }
+
+    static size_t shard_of(Key key)
+    {
+      return (key >> 24) & 0xFF;
+    }
+
+    static uint32_t index_of(Key key)
+    {
+      return key & 0xFFFFFF;
+    }
+
+    static size_t this_shard()
+    {
+      static thread_local size_t r =
+        std::hash<std::thread::id>{}(std::this_thread::get_id()) % num_shards;
+      return r;
+    }
+
+    Slot* find_slot(Key key) const
+    {
+      auto shard = shard_of(key);
+      auto index = index_of(key);
+      if (shard >= num_shards || index >= chunk_size * max_chunks)
+        return nullptr;
+      auto chunk = shards[shard].chunks[index / chunk_size].load(
+        std::memory_order_acquire);
+      if (!chunk)
+        return nullptr;
+      return &chunk->slots[index % chunk_size];
+    }
+  };
+}
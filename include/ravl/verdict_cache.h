@@ -0,0 +1,318 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "attestation.h"
+#include "crypto.h"
+#include "sev_snp.h"
+//
+#include "aci.h"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+namespace ravl
+{
+  /// Hit/miss counters of the verdict cache
+  struct VerdictCacheStatistics
+  {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+  };
+
+  /// Thread-safe cache of verification results (claims) of whole
+  /// attestations, bounded by an (estimated) number of bytes. Entries are
+  /// tagged with the platform they were verified for (e.g. an SGX FMSPC) and
+  /// become invalid when newer endorsements (CRLs, TCB info) for that platform
+  /// are loaded.
+  class VerdictCache
+  {
+  public:
+    using Clock = std::chrono::system_clock;
+
+    static constexpr size_t default_max_bytes = 64 * 1024 * 1024;
+
+    /// Constructor
+    VerdictCache(size_t max_bytes_ = default_max_bytes) : max_bytes(max_bytes_)
+    {}
+
+    virtual ~VerdictCache() = default;
+
+    /// Find a valid entry (returns a copy of the cached claims)
+    std::shared_ptr<Claims> find(const std::string& key)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+
+      auto it = entries.find(key);
+      if (it == entries.end())
+      {
+        misses++;
+        return nullptr;
+      }
+
+      const auto& e = it->second;
+      if (
+        e.expiry <= Clock::now() || e.generation != generation_of(e.platform))
+      {
+        erase(it);
+        misses++;
+        return nullptr;
+      }
+
+      lru.splice(lru.begin(), lru, e.lru_it);
+      hits++;
+      return e.claims->clone();
+    }
+
+    /// Current generation of the endorsements of a platform; take this before
+    /// verifying an attestation and pass it to insert().
+    uint64_t generation(const std::string& platform) const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      return generation_of(platform);
+    }
+
+    /// Insert an entry (ignored if newer endorsements for the platform have
+    /// been loaded since `generation_` was taken, or if the entry is too big)
+    void insert(
+      const std::string& key,
+      const std::string& platform,
+      uint64_t generation_,
+      std::shared_ptr<const Claims> claims,
+      size_t size,
+      Clock::time_point expiry)
+    {
+      size += key.size() + platform.size() + sizeof(Entry);
+
+      if (!claims || expiry <= Clock::now())
+        return;
+
+      std::lock_guard<std::mutex> guard(mtx);
+
+      if (size > max_bytes || generation_ != generation_of(platform))
+        return;
+
+      auto it = entries.find(key);
+      if (it != entries.end())
+        erase(it);
+
+      lru.push_front(key);
+      entries.emplace(
+        key,
+        Entry{
+          std::move(claims), platform, generation_, size, expiry, lru.begin()});
+      total_bytes += size;
+
+      shrink();
+    }
+
+    /// Invalidate all entries for a platform (when newer endorsements for it
+    /// have been loaded)
+    void invalidate(const std::string& platform)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      generations[platform]++;
+      invalidations++;
+    }
+
+    /// Set the memory budget (evicting least recently used entries if
+    /// necessary)
+    void set_max_bytes(size_t max_bytes_)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      max_bytes = max_bytes_;
+      shrink();
+    }
+
+    /// Remove all entries.
+    void clear()
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      entries.clear();
+      lru.clear();
+      total_bytes = 0;
+    }
+
+    /// Number of entries (including invalid ones that have not been evicted)
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      return entries.size();
+    }
+
+    /// Estimated memory use of all entries
+    size_t bytes() const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      return total_bytes;
+    }
+
+    /// Hit/miss counters
+    VerdictCacheStatistics statistics() const
+    {
+      return {hits.load(), misses.load(), invalidations.load()};
+    }
+
+  protected:
+    struct Entry
+    {
+      std::shared_ptr<const Claims> claims;
+      std::string platform;
+      uint64_t generation;
+      size_t size;
+      Clock::time_point expiry;
+      std::list<std::string>::iterator lru_it;
+    };
+
+    using Entries = std::unordered_map<std::string, Entry>;
+
+    mutable std::mutex mtx;
+    size_t max_bytes;
+    size_t total_bytes = 0;
+    Entries entries;
+    std::list<std::string> lru;
+    std::unordered_map<std::string, uint64_t> generations;
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    std::atomic<uint64_t> invalidations = 0;
+
+    uint64_t generation_of(const std::string& platform) const
+    {
+      auto it = generations.find(platform);
+      return it == generations.end() ? 0 : it->second;
+    }
+
+    void erase(Entries::iterator it)
+    {
+      total_bytes -= it->second.size;
+      lru.erase(it->second.lru_it);
+      entries.erase(it);
+    }
+
+    void shrink()
+    {
+      while (total_bytes > max_bytes && !lru.empty())
+        erase(entries.find(lru.back()));
+    }
+  };
+
+  /// Get the process-wide verdict cache.
+  inline VerdictCache& verdict_cache()
+  {
+    static VerdictCache cache;
+    return cache;
+  }
+
+  /// Compute the verdict cache key of an attestation, i.e. a digest of its
+  /// source, evidence, endorsements and of the options that affect the
+  /// verification result.
+  inline std::string verdict_key(
+    const Attestation& attestation, const Options& options)
+  {
+    using namespace crypto;
+
+    UqEVP_MD_CTX ctx(EVP_sha256());
+
+    auto add = [&ctx](const std::span<const uint8_t>& data) {
+      uint64_t sz = data.size();
+      ctx.update({(const uint8_t*)&sz, sizeof(sz)});
+      ctx.update(data);
+    };
+    auto add_string = [&add](const std::optional<std::string>& s) {
+      if (s)
+        add({(const uint8_t*)s->data(), s->size()});
+      else
+        add({});
+    };
+
+    uint8_t source = static_cast<uint8_t>(attestation.source);
+    add({&source, 1});
+    add(attestation.evidence);
+    add(attestation.endorsements);
+    if (auto aci = dynamic_cast<const aci::Attestation*>(&attestation))
+      add(aci->uvm_endorsements);
+
+    const auto& cvo = options.certificate_verification;
+    uint8_t flags[] = {
+      cvo.ignore_time,
+      cvo.verification_time.has_value(),
+      options.check_root_certificate_manufacturer_key,
+      options.historical,
+      options.partial};
+    add(flags);
+    int64_t verification_time = cvo.verification_time.value_or(0);
+    add({(const uint8_t*)&verification_time, sizeof(verification_time)});
+    add_string(options.root_ca_certificate);
+    add_string(options.sgx_endorsement_cache_url_template);
+    add_string(options.sev_snp_endorsement_cache_url_template);
+
+    return to_hex(ctx.final());
+  }
+
+  /// Verdict cache lookup state of a verification in progress
+  struct VerdictCacheTicket
+  {
+    std::string key;
+    std::string platform;
+    uint64_t generation = 0;
+  };
+
+  /// Find the cached verdict for an attestation. On a miss, returns nullptr
+  /// and sets `ticket` for a subsequent cache_verdict().
+  inline std::shared_ptr<Claims> find_verdict(
+    const Attestation& attestation,
+    const Options& options,
+    std::optional<VerdictCacheTicket>& ticket)
+  {
+    ticket = std::nullopt;
+
+    if (
+      !options.cache_verdicts || options.fresh_endorsements ||
+      options.fresh_root_ca_certificate)
+      return nullptr;
+
+    auto key = verdict_key(attestation, options);
+    auto& cache = verdict_cache();
+
+    if (auto claims = cache.find(key))
+      return claims;
+
+    auto platform = attestation.platform_id();
+    if (platform.empty())
+      return nullptr;
+
+    auto generation = cache.generation(platform);
+    ticket = VerdictCacheTicket{key, platform, generation};
+    return nullptr;
+  }
+
+  /// Cache the verdict (claims) of a successful verification.
+  inline void cache_verdict(
+    const VerdictCacheTicket& ticket,
+    const Options& options,
+    const std::shared_ptr<Claims>& claims)
+  {
+    if (!claims)
+      return;
+
+    auto copy = claims->clone();
+    if (!copy)
+      return;
+
+    auto size = copy->to_json().size();
+    auto expiry = VerdictCache::Clock::now() +
+      std::chrono::seconds(options.verdict_cache_ttl);
+
+    verdict_cache().insert(
+      ticket.key, ticket.platform, ticket.generation, copy, size, expiry);
+  }
+}
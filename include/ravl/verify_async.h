@@ -0,0 +1,147 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "attestation.h"
+#include "http_client.h"
+#include "options.h"
+#include "request_tracker.h"
+
+#include <algorithm>
+#include <coroutine>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+namespace ravl
+{
+  /// Executor for the continuations of coroutines awaiting verification
+  /// results; nullptr resumes them on the thread that completes the
+  /// verification (a worker of the tracker's verification pool, if it has
+  /// one, or otherwise the HTTP client's).
+  typedef std::function<void(std::coroutine_handle<>)> VerificationExecutor;
+
+  /// Request tracker for verify_async, with a verification pool of one worker
+  /// per CPU, so that neither verification nor the coroutines run on the
+  /// HTTP client's thread
+  inline AttestationRequestTracker& async_request_tracker()
+  {
+    static AttestationRequestTracker tracker(WorkerPoolOptions{
+      .threads = std::max(1u, std::thread::hardware_concurrency())});
+    return tracker;
+  }
+
+  /// Asynchronous HTTP client for verify_async, shared by all verifications
+  /// with the same HTTP options
+  inline std::shared_ptr<HTTPClient> async_http_client(const Options& options)
+  {
+    typedef std::tuple<size_t, size_t, bool, size_t, bool, bool> Key;
+    static std::mutex mtx;
+    static std::map<Key, std::shared_ptr<HTTPClient>> clients;
+
+    Key key = {
+      options.http_timeout,
+      options.http_max_attempts,
+      options.verbosity > 0,
+      options.http_connection_idle_timeout,
+      options.http2,
+      options.http_compression};
+
+    std::lock_guard<std::mutex> guard(mtx);
+    auto& r = clients[key];
+    if (!r)
+      r = std::make_shared<AsynchronousHTTPClient>(
+        options.http_timeout,
+        options.http_max_attempts,
+        options.verbosity > 0,
+        options.http_connection_idle_timeout,
+        options.http2,
+        options.http_compression);
+    return r;
+  }
+
+  /// Awaitable result of verify_async
+  class VerificationAwaitable
+  {
+  public:
+    VerificationAwaitable(
+      AttestationRequestTracker& tracker_,
+      std::shared_ptr<const Attestation> attestation_,
+      const Options& options_,
+      std::shared_ptr<HTTPClient> http_client_,
+      VerificationExecutor executor_) :
+      tracker(tracker_),
+      attestation(attestation_),
+      options(options_),
+      http_client(http_client_),
+      executor(std::move(executor_))
+    {}
+
+    bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    // Submits the request and suspends until it completes; does not suspend
+    // if it completes right away (e.g. with cached endorsements).
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      id = tracker.submit(options, attestation, http_client);
+
+      // The coroutine may be resumed (on another thread) before this
+      // returns, so `this` must not be used after registration.
+      auto exec = executor;
+      return tracker.when_complete(
+        id, [handle, exec](AttestationRequestTracker::RequestState) {
+          if (exec)
+            exec(handle);
+          else
+            handle.resume();
+        });
+    }
+
+    std::shared_ptr<Claims> await_resume()
+    {
+      std::shared_ptr<Claims> r;
+      if (tracker.state(id) == AttestationRequestTracker::FINISHED)
+        r = tracker.result(id);
+      tracker.erase(id);
+      if (!r)
+        throw std::runtime_error("attestation verification failed");
+      return r;
+    }
+
+  protected:
+    AttestationRequestTracker& tracker;
+    std::shared_ptr<const Attestation> attestation;
+    Options options;
+    std::shared_ptr<HTTPClient> http_client;
+    VerificationExecutor executor;
+    AttestationRequestTracker::RequestID id = 0;
+  };
+
+  /// Asynchronous verification for C++20 coroutines: `co_await` the result
+  /// to suspend while endorsements are downloaded. The coroutine is resumed
+  /// via `executor` when verification completes; there is no polling and no
+  /// waiting thread. http_client should be asynchronous (a synchronous one
+  /// downloads before the coroutine is suspended); by default, a shared
+  /// AsynchronousHTTPClient is used.
+  inline VerificationAwaitable verify_async(
+    std::shared_ptr<const Attestation> attestation,
+    const Options& options = Options(),
+    std::shared_ptr<HTTPClient> http_client = nullptr,
+    VerificationExecutor executor = nullptr,
+    AttestationRequestTracker& tracker = async_request_tracker())
+  {
+    if (!http_client)
+      http_client = async_http_client(options);
+
+    return VerificationAwaitable(
+      tracker, attestation, options, http_client, std::move(executor));
+  }
+}
@@ -0,0 +1,239 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+namespace ravl
+{
+  /// Configuration of a worker pool
+  struct WorkerPoolOptions
+  {
+    /// Number of worker threads (0 = no pool; tasks run on the submitting
+    /// thread)
+    size_t threads = 0;
+
+    /// Pin worker i to CPU (first_cpu + i) modulo the number of CPUs (Linux
+    /// only)
+    bool pin = false;
+
+    /// First CPU to pin workers to
+    size_t first_cpu = 0;
+  };
+
+  /// Pool of worker threads with a task queue per worker. Tasks submitted by
+  /// a worker go to its own queue, others are distributed round-robin. Workers
+  /// take the most recent task from their own queue, and when it is empty,
+  /// steal the oldest task from the queues of the others. Idle workers sleep
+  /// on their own condition variable; a new task wakes the owner of its queue
+  /// if it is idle, or otherwise one other idle worker.
+  class WorkerPool
+  {
+  public:
+    typedef std::function<void()> Task;
+
+    WorkerPool(const WorkerPoolOptions& options = {})
+    {
+      size_t num_cpus = std::max(1u, std::thread::hardware_concurrency());
+
+      for (size_t i = 0; i < options.threads; i++)
+        workers.push_back(std::make_unique<Worker>());
+
+      for (size_t i = 0; i < workers.size(); i++)
+      {
+        workers[i]->thread = std::thread(&WorkerPool::run, this, i);
+        if (options.pin)
+          pin(workers[i]->thread, (options.first_cpu + i) % num_cpus);
+      }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /// Destructor; runs the remaining tasks before the workers are joined.
+    virtual ~WorkerPool()
+    {
+      stopping = true;
+
+      for (auto& w : workers)
+      {
+        {
+          std::lock_guard<std::mutex> guard(w->sleep_mtx);
+          w->sleeping = false;
+        }
+        w->cv.notify_one();
+      }
+
+      for (auto& w : workers)
+        w->thread.join();
+    }
+
+    /// Number of worker threads
+    size_t size() const
+    {
+      return workers.size();
+    }
+
+    /// Whether the calling thread is one of the workers
+    bool on_worker() const
+    {
+      return current_pool == this;
+    }
+
+    /// Submit a task (which runs right away if there are no workers).
+    void submit(Task&& task)
+    {
+      if (workers.empty())
+      {
+        task();
+        return;
+      }
+
+      size_t i = current_pool == this ?
+        current_worker :
+        next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+
+      {
+        std::lock_guard<std::mutex> guard(workers[i]->mtx);
+        workers[i]->tasks.push_back(std::move(task));
+        pending++;
+      }
+
+      wake(i);
+    }
+
+  protected:
+    struct Worker
+    {
+      std::mutex mtx;
+      std::deque<Task> tasks;
+      std::thread thread;
+
+      // Set by the worker before it waits for tasks, and cleared by the
+      // thread that wakes it
+      std::atomic<bool> sleeping = false;
+      std::mutex sleep_mtx;
+      std::condition_variable cv;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker = 0;
+
+    // Number of tasks in the queues (changed with the lock of the queue)
+    std::atomic<size_t> pending = 0;
+    std::atomic<bool> stopping = false;
+
+    static inline thread_local WorkerPool* current_pool = nullptr;
+    static inline thread_local size_t current_worker = 0;
+
+    void run(size_t index)
+    {
+      current_pool = this;
+      current_worker = index;
+
+      auto& self = *workers[index];
+
+      while (true)
+      {
+        if (auto task = take(index))
+        {
+          // Tasks are expected to handle their errors; an exception must not
+          // take down the worker.
+          try
+          {
+            task();
+          }
+          catch (...)
+          {}
+          continue;
+        }
+
+        if (stopping && pending == 0)
+          return;
+
+        // Announce that this worker sleeps before checking for tasks again,
+        // so that a concurrent submit() either sees it sleeping or its task
+        // is seen here.
+        std::unique_lock<std::mutex> lock(self.sleep_mtx);
+        self.sleeping = true;
+        if (pending == 0 && !stopping)
+          self.cv.wait(lock, [&self]() { return !self.sleeping; });
+        self.sleeping = false;
+      }
+    }
+
+    // Wake worker `index` if it sleeps, or otherwise another sleeping worker
+    // (if any).
+    void wake(size_t index)
+    {
+      for (size_t n = 0; n < workers.size(); n++)
+      {
+        auto& w = *workers[(index + n) % workers.size()];
+        bool expected = true;
+        if (w.sleeping.compare_exchange_strong(expected, false))
+        {
+          {
+            std::lock_guard<std::mutex> guard(w.sleep_mtx);
+          }
+          w.cv.notify_one();
+          return;
+        }
+      }
+    }
+
+    // Take a task from the worker's own queue, or steal one from another
+    // (an empty task if there is none).
+    Task take(size_t index)
+    {
+      for (size_t n = 0; n < workers.size(); n++)
+      {
+        size_t i = (index + n) % workers.size();
+        auto& w = *workers[i];
+        std::lock_guard<std::mutex> guard(w.mtx);
+        if (w.tasks.empty())
+          continue;
+        Task r;
+        if (i == index)
+        {
+          r = std::move(w.tasks.back());
+          w.tasks.pop_back();
+        }
+        else
+        {
+          r = std::move(w.tasks.front());
+          w.tasks.pop_front();
+        }
+        pending--;
+        return r;
+      }
+      return nullptr;
+    }
+
+    static void pin(std::thread& thread, size_t cpu)
+    {
+#ifdef __linux__
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+      (void)thread;
+      (void)cpu;
+#endif
+    }
+  };
+}
@@ -25,10 +25,19 @@ int main(int argc, const char** argv)
       options.certificate_verification.ignore_time,
       "Ignore expiry time of certificates");
 
+    std::string endorsement_store_path;
+    app.add_option(
+      "-s",
+      endorsement_store_path,
+      "File in which to keep downloaded endorsements");
+
     app.allow_config_extras(true);
 
     app.parse(argc, argv);
 
+    if (!endorsement_store_path.empty())
+      options.endorsement_store_path = endorsement_store_path;
+
     for (auto f : app.remaining())
     {
       std::ifstream is(f);
@@ -0,0 +1,661 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+#include "ravl/endorsement_store.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifndef __EMSCRIPTEN__
+#  include <fcntl.h>
+#  include <sys/file.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#define FMT_HEADER_ONLY
+#include <fmt/format.h>
+
+namespace ravl
+{
+  // File format (native byte order): the file magic, followed by records, each
+  // of which is a RecordHeader followed by the key (URL) and the value (a
+  // serialized HTTPResponse). Readers stop at the first incomplete or corrupt
+  // record; writers truncate such trailing data before appending.
+
+  static constexpr char file_magic[8] = {
+    'R', 'A', 'V', 'L', 'E', 'S', '0', '1'};
+  static constexpr uint32_t record_magic = 0x52454331;
+
+  // Compact when the file is at least this big and more than half of it is
+  // expired or superseded.
+  static constexpr size_t compaction_threshold = 1 << 20;
+
+  struct RecordHeader
+  {
+    uint32_t magic;
+    uint32_t key_size;
+    uint64_t value_size;
+    int64_t expiry; // seconds since the epoch
+    uint64_t checksum; // FNV-1a over key and value
+  };
+
+  static uint64_t fnv1a(
+    const void* data, size_t size, uint64_t h = 0xcbf29ce484222325)
+  {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+      h ^= p[i];
+      h *= 0x100000001b3;
+    }
+    return h;
+  }
+
+  template <typename T>
+  static void put(std::string& out, const T& value)
+  {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  static void put(std::string& out, const std::string& value)
+  {
+    put<uint64_t>(out, value.size());
+    out += value;
+  }
+
+  class Reader
+  {
+  public:
+    Reader(const uint8_t* data, size_t size) : pos(data), end(data + size) {}
+
+    template <typename T>
+    T get()
+    {
+      T r;
+      std::memcpy(&r, take(sizeof(T)), sizeof(T));
+      return r;
+    }
+
+    std::string get_string()
+    {
+      auto sz = get<uint64_t>();
+      return std::string(reinterpret_cast<const char*>(take(sz)), sz);
+    }
+
+  protected:
+    const uint8_t* pos;
+    const uint8_t* end;
+
+    const uint8_t* take(size_t n)
+    {
+      if (n > static_cast<size_t>(end - pos))
+        throw std::runtime_error("endorsement store record too short");
+      auto r = pos;
+      pos += n;
+      return r;
+    }
+  };
+
+  static std::string serialize(const HTTPResponse& response)
+  {
+    std::string r;
+    put<uint32_t>(r, response.status);
+    put<uint32_t>(r, response.headers.size());
+    for (const auto& [k, v] : response.headers)
+    {
+      put(r, k);
+      put(r, v);
+    }
+    put(r, response.body);
+    return r;
+  }
+
+  static HTTPResponse deserialize(const uint8_t* data, size_t size)
+  {
+    HTTPResponse r;
+    Reader reader(data, size);
+    r.status = reader.get<uint32_t>();
+    auto num_headers = reader.get<uint32_t>();
+    for (size_t i = 0; i < num_headers; i++)
+    {
+      auto k = reader.get_string();
+      r.headers[k] = reader.get_string();
+    }
+    r.body = reader.get_string();
+    return r;
+  }
+
+#ifndef __EMSCRIPTEN__
+  static void write_all(int fd, const void* data, size_t size, off_t offset)
+  {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+      auto n = pwrite(fd, p, size, offset);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error(fmt::format(
+          "endorsement store write failed: {}", std::strerror(errno)));
+      }
+      p += n;
+      size -= n;
+      offset += n;
+    }
+  }
+
+  class FileLock
+  {
+  public:
+    FileLock(int fd_) : fd(fd_)
+    {
+      while (flock(fd, LOCK_EX) != 0)
+        if (errno != EINTR)
+          throw std::runtime_error(fmt::format(
+            "endorsement store lock failed: {}", std::strerror(errno)));
+    }
+
+    ~FileLock()
+    {
+      flock(fd, LOCK_UN);
+    }
+
+  protected:
+    int fd;
+  };
+
+  class EndorsementStoreImpl
+  {
+  public:
+    using Clock = EndorsementStore::Clock;
+
+    EndorsementStoreImpl(const std::string& path_) : path(path_)
+    {
+      open_file();
+      sync();
+    }
+
+    virtual ~EndorsementStoreImpl()
+    {
+      close_file();
+    }
+
+    std::optional<HTTPResponse> find(const std::string& url)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      sync();
+      drop_expired();
+      return find_locked(url);
+    }
+
+    std::optional<HTTPResponses> find(const HTTPRequests& requests)
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      sync();
+      drop_expired();
+
+      HTTPResponses r;
+      r.reserve(requests.size());
+      for (const auto& request : requests)
+      {
+        auto response = find_locked(request.url);
+        if (!response)
+          return std::nullopt;
+        r.push_back(std::move(*response));
+      }
+      return r;
+    }
+
+    void insert(
+      const std::vector<std::pair<std::string, std::string>>& records,
+      Clock::time_point expiry)
+    {
+      if (expiry <= Clock::now() || records.empty())
+        return;
+
+      auto expiry_s = std::chrono::duration_cast<std::chrono::seconds>(
+        expiry.time_since_epoch());
+
+      std::lock_guard<std::mutex> guard(mtx);
+      sync();
+      drop_expired();
+
+      // Records that are stored already (e.g. because several verifications
+      // used the same download) are not appended again.
+      std::string buffer;
+      for (const auto& [key, value] : records)
+      {
+        if (unchanged(key, value, Clock::time_point(expiry_s)))
+          continue;
+
+        RecordHeader h;
+        h.magic = record_magic;
+        h.key_size = key.size();
+        h.value_size = value.size();
+        h.expiry = expiry_s.count();
+        h.checksum =
+          fnv1a(value.data(), value.size(), fnv1a(key.data(), key.size()));
+        put(buffer, h);
+        buffer += key;
+        buffer += value;
+      }
+
+      if (buffer.empty())
+        return;
+
+      // Another process may compact (replace) or truncate the file while we
+      // are waiting for the lock, in which case we reopen it and try again.
+      while (!append(buffer))
+      {
+        close_file();
+        open_file();
+      }
+
+      sync();
+
+      if (end >= compaction_threshold && end > 2 * live_bytes)
+        compact_locked();
+    }
+
+    void compact()
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      compact_locked();
+    }
+
+    size_t size()
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      sync();
+      drop_expired();
+      return index.size();
+    }
+
+  protected:
+    struct Location
+    {
+      size_t offset; // of the value
+      size_t size; // of the value
+      size_t record_size;
+      Clock::time_point expiry;
+    };
+
+    std::string path;
+    int fd = -1;
+    const uint8_t* map = nullptr;
+    size_t map_size = 0;
+    size_t end = 0;
+    size_t live_bytes = 0;
+    std::mutex mtx;
+    std::unordered_map<std::string, Location> index;
+    std::multimap<Clock::time_point, std::string> by_expiry;
+
+    void open_file()
+    {
+      fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+      if (fd < 0)
+        throw std::runtime_error(fmt::format(
+          "cannot open endorsement store '{}': {}",
+          path,
+          std::strerror(errno)));
+
+      bool valid = false;
+      {
+        FileLock lock(fd);
+        struct stat st;
+        char magic[sizeof(file_magic)];
+        if (fstat(fd, &st) == 0 && st.st_size == 0)
+          write_all(fd, file_magic, sizeof(file_magic), 0);
+        valid = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+          std::memcmp(magic, file_magic, sizeof(magic)) == 0;
+      }
+
+      if (!valid)
+      {
+        close_file();
+        throw std::runtime_error(
+          fmt::format("invalid endorsement store '{}'", path));
+      }
+
+      end = sizeof(file_magic);
+      live_bytes = 0;
+      index.clear();
+      by_expiry.clear();
+    }
+
+    void close_file()
+    {
+      if (map)
+        munmap(const_cast<uint8_t*>(map), map_size);
+      map = nullptr;
+      map_size = 0;
+      if (fd >= 0)
+        ::close(fd);
+      fd = -1;
+    }
+
+    bool stale() const
+    {
+      struct stat st_path, st_fd;
+      return stat(path.c_str(), &st_path) == 0 && fstat(fd, &st_fd) == 0 &&
+        (st_path.st_ino != st_fd.st_ino || st_path.st_dev != st_fd.st_dev);
+    }
+
+    void remap(size_t size)
+    {
+      if (size == map_size)
+        return;
+
+      if (map)
+        munmap(const_cast<uint8_t*>(map), map_size);
+      map = nullptr;
+      map_size = 0;
+
+      if (size > 0)
+      {
+        void* m = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+          throw std::runtime_error(fmt::format(
+            "cannot map endorsement store: {}", std::strerror(errno)));
+        map = static_cast<const uint8_t*>(m);
+        map_size = size;
+      }
+    }
+
+    // Index records appended since the last call, by us or other processes.
+    // Returns false if the file has been truncated by someone else, in which
+    // case it must be reopened (which the caller does once it has released
+    // the file lock, if it holds it).
+    bool refresh()
+    {
+      struct stat st;
+      if (fstat(fd, &st) != 0)
+        throw std::runtime_error("cannot stat endorsement store");
+
+      size_t size = st.st_size;
+      if (size < end)
+        return false;
+
+      remap(size);
+
+      while (end + sizeof(RecordHeader) <= map_size)
+      {
+        RecordHeader h;
+        std::memcpy(&h, map + end, sizeof(h));
+
+        if (h.magic != record_magic)
+          break;
+
+        size_t key_offset = end + sizeof(RecordHeader);
+        if (
+          h.value_size > map_size ||
+          key_offset + h.key_size + h.value_size > map_size)
+          break;
+
+        size_t value_offset = key_offset + h.key_size;
+        auto key_checksum = fnv1a(map + key_offset, h.key_size);
+        auto checksum = fnv1a(map + value_offset, h.value_size, key_checksum);
+        if (checksum != h.checksum)
+          break;
+
+        size_t record_size = sizeof(RecordHeader) + h.key_size + h.value_size;
+        std::string key(
+          reinterpret_cast<const char*>(map + key_offset), h.key_size);
+        Location loc = {
+          value_offset,
+          h.value_size,
+          record_size,
+          Clock::time_point(std::chrono::seconds(h.expiry))};
+        add_to_index(key, loc);
+
+        end += record_size;
+      }
+
+      return true;
+    }
+
+    void sync()
+    {
+      while (!refresh())
+      {
+        close_file();
+        open_file();
+      }
+    }
+
+    void add_to_index(const std::string& key, const Location& loc)
+    {
+      remove_from_index(key);
+
+      if (loc.expiry <= Clock::now())
+        return;
+
+      index.emplace(key, loc);
+      by_expiry.emplace(loc.expiry, key);
+      live_bytes += loc.record_size;
+    }
+
+    void remove_from_index(const std::string& key)
+    {
+      auto it = index.find(key);
+      if (it == index.end())
+        return;
+
+      auto [first, last] = by_expiry.equal_range(it->second.expiry);
+      for (auto eit = first; eit != last; eit++)
+        if (eit->second == key)
+        {
+          by_expiry.erase(eit);
+          break;
+        }
+
+      live_bytes -= it->second.record_size;
+      index.erase(it);
+    }
+
+    void drop_expired()
+    {
+      auto now = Clock::now();
+      while (!by_expiry.empty() && by_expiry.begin()->first <= now)
+        remove_from_index(by_expiry.begin()->second);
+    }
+
+    bool unchanged(
+      const std::string& key,
+      const std::string& value,
+      Clock::time_point expiry) const
+    {
+      auto it = index.find(key);
+      return it != index.end() && it->second.expiry >= expiry &&
+        it->second.size == value.size() &&
+        std::memcmp(map + it->second.offset, value.data(), value.size()) == 0;
+    }
+
+    bool append(const std::string& buffer)
+    {
+      FileLock lock(fd);
+
+      if (stale() || !refresh())
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0)
+        throw std::runtime_error("cannot stat endorsement store");
+      if (static_cast<size_t>(st.st_size) > end && ftruncate(fd, end) != 0)
+        throw std::runtime_error("cannot truncate endorsement store");
+
+      write_all(fd, buffer.data(), buffer.size(), end);
+      return true;
+    }
+
+    std::optional<HTTPResponse> find_locked(const std::string& url) const
+    {
+      auto it = index.find(url);
+      if (it == index.end())
+        return std::nullopt;
+      return deserialize(map + it->second.offset, it->second.size);
+    }
+
+    void compact_locked()
+    {
+      {
+        FileLock lock(fd);
+        if (!stale()) // Otherwise, someone else compacted it already.
+          rewrite();
+      }
+
+      close_file();
+      open_file();
+      sync();
+    }
+
+    void rewrite()
+    {
+      // If someone else truncated the file, there is nothing to keep.
+      if (!refresh())
+        return;
+      drop_expired();
+
+      std::string tmp_path = path + ".tmp";
+      int tmp_fd = ::open(
+        tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if (tmp_fd < 0)
+        throw std::runtime_error(fmt::format(
+          "cannot create '{}': {}", tmp_path, std::strerror(errno)));
+
+      try
+      {
+        std::string buffer(file_magic, sizeof(file_magic));
+        for (const auto& [key, loc] : index)
+        {
+          size_t offset = loc.offset - key.size() - sizeof(RecordHeader);
+          buffer.append(
+            reinterpret_cast<const char*>(map + offset), loc.record_size);
+        }
+        write_all(tmp_fd, buffer.data(), buffer.size(), 0);
+        if (fsync(tmp_fd) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0)
+          throw std::runtime_error(fmt::format(
+            "cannot replace endorsement store: {}", std::strerror(errno)));
+      }
+      catch (...)
+      {
+        ::close(tmp_fd);
+        unlink(tmp_path.c_str());
+        throw;
+      }
+
+      ::close(tmp_fd);
+    }
+  };
+#else
+  // WebAssembly builds have no memory-mapped files or file locks; the store
+  // keeps nothing, so endorsements are always downloaded.
+  class EndorsementStoreImpl
+  {
+  public:
+    using Clock = EndorsementStore::Clock;
+
+    EndorsementStoreImpl(const std::string&) {}
+
+    virtual ~EndorsementStoreImpl() = default;
+
+    std::optional<HTTPResponse> find(const std::string&)
+    {
+      return std::nullopt;
+    }
+
+    std::optional<HTTPResponses> find(const HTTPRequests&)
+    {
+      return std::nullopt;
+    }
+
+    void insert(
+      const std::vector<std::pair<std::string, std::string>>&,
+      Clock::time_point)
+    {}
+
+    void compact() {}
+
+    size_t size()
+    {
+      return 0;
+    }
+  };
+#endif
+
+  EndorsementStore::EndorsementStore(const std::string& path)
+  {
+    implementation = new EndorsementStoreImpl(path);
+  }
+
+  EndorsementStore::~EndorsementStore()
+  {
+    delete static_cast<EndorsementStoreImpl*>(implementation);
+  }
+
+  std::optional<HTTPResponse> EndorsementStore::find(const std::string& url)
+  {
+    return static_cast<EndorsementStoreImpl*>(implementation)->find(url);
+  }
+
+  std::optional<HTTPResponses> EndorsementStore::find(
+    const HTTPRequests& requests)
+  {
+    return static_cast<EndorsementStoreImpl*>(implementation)->find(requests);
+  }
+
+  void EndorsementStore::insert(
+    const std::string& url,
+    const HTTPResponse& response,
+    Clock::time_point expiry)
+  {
+    static_cast<EndorsementStoreImpl*>(implementation)
+      ->insert({{url, serialize(response)}}, expiry);
+  }
+
+  void EndorsementStore::insert(
+    const HTTPRequests& requests,
+    const HTTPResponses& responses,
+    Clock::time_point expiry)
+  {
+    if (requests.size() != responses.size())
+      throw std::runtime_error("request/response set size mismatch");
+
+    std::vector<std::pair<std::string, std::string>> records;
+    for (size_t i = 0; i < requests.size(); i++)
+      records.emplace_back(requests[i].url, serialize(responses[i]));
+
+    static_cast<EndorsementStoreImpl*>(implementation)
+      ->insert(records, expiry);
+  }
+
+  void EndorsementStore::compact()
+  {
+    static_cast<EndorsementStoreImpl*>(implementation)->compact();
+  }
+
+  size_t EndorsementStore::size() const
+  {
+    return static_cast<EndorsementStoreImpl*>(implementation)->size();
+  }
+
+  std::shared_ptr<EndorsementStore> EndorsementStore::get(
+    const std::string& path)
+  {
+    static std::mutex mtx;
+    static std::map<std::string, std::shared_ptr<EndorsementStore>> stores;
+
+    std::lock_guard<std::mutex> guard(mtx);
+    auto it = stores.find(path);
+    if (it == stores.end())
+      it = stores.emplace(path, std::make_shared<EndorsementStore>(path)).first;
+    return it->second;
+  }
+}
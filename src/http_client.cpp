@@ -14,8 +14,19 @@
 namespace ravl
 {
   SynchronousHTTPClient::SynchronousHTTPClient(
-    size_t request_timeout_, size_t max_attempts_, bool verbose_) :
-    HTTPClient(request_timeout_, max_attempts_, verbose_)
+    size_t request_timeout_,
+    size_t max_attempts_,
+    bool verbose_,
+    size_t connection_idle_timeout_,
+    bool http2_,
+    bool compression_) :
+    HTTPClient(
+      request_timeout_,
+      max_attempts_,
+      verbose_,
+      connection_idle_timeout_,
+      http2_,
+      compression_)
   {}
 
   HTTPRequestSetId SynchronousHTTPClient::submit(
@@ -30,15 +41,24 @@ namespace ravl
     if (!ok)
       throw std::bad_alloc();
 
-    auto rsit = request_sets.find(id);
-    for (size_t i = 0; i < rsit->second.size(); i++)
-    {
-      auto& request = rsit->second.at(i);
-      HTTPResponse response =
-        execute_synchronous(request, request_timeout, max_attempts, verbose);
-      response_sets[id][i] = response;
+    // All requests of the set are in flight at once; the responses are in
+    // the order of the requests.
+    const auto& requests = request_sets.find(id)->second;
+    rit->second = execute_synchronous(
+      requests,
+      request_timeout,
+      max_attempts,
+      verbose,
+      connection_idle_timeout,
+      http2,
+      compression);
 
-      if (response.status != 200)
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+      const auto& response = rit->second[i];
+      bool not_modified =
+        response.status == 304 && is_conditional(requests[i]);
+      if (response.status != 200 && !not_modified)
         throw std::runtime_error(
           fmt::format("unexpected HTTP status {}", response.status));
     }
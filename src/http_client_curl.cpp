@@ -2,33 +2,284 @@
 // Licensed under the MIT License.
 
 #include "ravl/http_client.h"
+#include "ravl/http_policy.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <curl/curl.h>
 #include <curl/easy.h>
 #include <curl/multi.h>
 #include <curl/urlapi.h>
+#include <deque>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <new>
+#include <optional>
 #include <ratio>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <vector>
 
 #define FMT_HEADER_ONLY
 #include <fmt/format.h>
 
 namespace ravl
 {
-  static bool initialized = false;
+  static void global_init()
+  {
+    static std::once_flag flag;
+    std::call_once(flag, []() {
+      curl_global_init(CURL_GLOBAL_ALL);
+      atexit(curl_global_cleanup);
+    });
+  }
+
+  // DNS and TLS session caches shared by all easy handles. (libcurl does not
+  // support sharing connection caches between concurrent threads; connections
+  // are kept alive by the pooled easy handles and the multi handles instead.)
+  class CurlShare
+  {
+  public:
+    CurlShare()
+    {
+      global_init();
+
+      share = curl_share_init();
+      if (!share)
+        throw std::bad_alloc();
+
+      curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+      curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+      curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+      curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    virtual ~CurlShare()
+    {
+      curl_share_cleanup(share);
+    }
+
+    CURLSH* share = nullptr;
+
+  protected:
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> mtxs;
+
+    static void lock(CURL*, curl_lock_data data, curl_lock_access, void* p)
+    {
+      static_cast<CurlShare*>(p)->mtxs.at(data).lock();
+    }
+
+    static void unlock(CURL*, curl_lock_data data, void* p)
+    {
+      static_cast<CurlShare*>(p)->mtxs.at(data).unlock();
+    }
+  };
+
+  static CURLSH* curl_share()
+  {
+    static CurlShare share;
+    return share.share;
+  }
+
+  // Pool of persistent easy handles, which keep their connections (and DNS
+  // and TLS session caches) across requests.
+  class EasyHandlePool
+  {
+  public:
+    static constexpr size_t max_size = 64;
+
+    EasyHandlePool()
+    {
+      // Make sure the share outlives the pool.
+      curl_share();
+    }
+
+    virtual ~EasyHandlePool()
+    {
+      for (auto h : handles)
+        curl_easy_cleanup(h);
+    }
+
+    CURL* acquire()
+    {
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!handles.empty())
+        {
+          CURL* r = handles.back();
+          handles.pop_back();
+          return r;
+        }
+      }
+
+      CURL* r = curl_easy_init();
+      if (!r)
+        throw std::bad_alloc();
+      return r;
+    }
+
+    void release(CURL* h)
+    {
+      // Resets the options, but keeps live connections and caches.
+      curl_easy_reset(h);
+
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (handles.size() < max_size)
+        {
+          handles.push_back(h);
+          return;
+        }
+      }
+
+      curl_easy_cleanup(h);
+    }
+
+  protected:
+    std::mutex mtx;
+    std::vector<CURL*> handles;
+  };
+
+  // Pool of multi handles, which keep their connection caches across
+  // request sets.
+  class MultiHandlePool
+  {
+  public:
+    static constexpr size_t max_size = 8;
+
+    MultiHandlePool()
+    {
+      curl_share();
+    }
+
+    virtual ~MultiHandlePool()
+    {
+      for (auto h : handles)
+        curl_multi_cleanup(h);
+    }
+
+    CURLM* acquire()
+    {
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (!handles.empty())
+        {
+          CURLM* r = handles.back();
+          handles.pop_back();
+          return r;
+        }
+      }
+
+      CURLM* r = curl_multi_init();
+      if (!r)
+        throw std::bad_alloc();
+      return r;
+    }
+
+    void release(CURLM* h)
+    {
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (handles.size() < max_size)
+        {
+          handles.push_back(h);
+          return;
+        }
+      }
+
+      curl_multi_cleanup(h);
+    }
+
+  protected:
+    std::mutex mtx;
+    std::vector<CURLM*> handles;
+  };
+
+  static EasyHandlePool& synchronous_pool()
+  {
+    static EasyHandlePool pool;
+    return pool;
+  }
+
+  // Easy handles taken from a pool, which are returned to it when the guard
+  // goes out of scope (also when an exception is thrown). Handles are removed
+  // from `multi` (if set) first.
+  struct EasyHandleGuard
+  {
+    EasyHandlePool& pool;
+    CURLM* multi = nullptr;
+    std::vector<CURL*> handles = {};
+
+    EasyHandleGuard(EasyHandlePool& pool_, CURLM* multi_ = nullptr) :
+      pool(pool_),
+      multi(multi_)
+    {}
+
+    EasyHandleGuard(const EasyHandleGuard&) = delete;
+    EasyHandleGuard& operator=(const EasyHandleGuard&) = delete;
+
+    ~EasyHandleGuard()
+    {
+      for (auto h : handles)
+      {
+        if (multi)
+          curl_multi_remove_handle(multi, h);
+        pool.release(h);
+      }
+    }
+
+    CURL* acquire()
+    {
+      handles.reserve(handles.size() + 1);
+      handles.push_back(pool.acquire());
+      return handles.back();
+    }
+  };
+
+  // Multi handle taken from a pool, returned to it when the guard goes out of
+  // scope
+  struct MultiHandleGuard
+  {
+    MultiHandlePool& pool;
+    CURLM* multi;
+
+    MultiHandleGuard(MultiHandlePool& pool_) :
+      pool(pool_),
+      multi(pool_.acquire())
+    {}
+
+    MultiHandleGuard(const MultiHandleGuard&) = delete;
+    MultiHandleGuard& operator=(const MultiHandleGuard&) = delete;
+
+    ~MultiHandleGuard()
+    {
+      pool.release(multi);
+    }
+  };
+
+  static constexpr size_t max_body_reservation = 16 * 1024 * 1024;
 
   static size_t body_write_fun(
     char* ptr, size_t size, size_t nmemb, void* userdata)
   {
     HTTPResponse* r = static_cast<HTTPResponse*>(userdata);
     size_t real_size = nmemb * size;
-    r->body += std::string(ptr, real_size);
+    r->body.append(ptr, real_size);
     return real_size;
   }
 
@@ -37,25 +288,74 @@ namespace ravl
   {
     HTTPResponse* r = static_cast<HTTPResponse*>(userdata);
     size_t real_size = nitems * size;
-    std::string h = std::string(buffer, real_size);
-    char* colon = std::strchr(buffer, ':');
-    if (colon != NULL)
+    if (auto header = parse_header_line({buffer, real_size}))
     {
-      std::string key(buffer, colon - buffer);
-      std::string value(colon + 2, real_size - (colon - buffer) - 1);
-      r->headers.emplace(std::make_pair(key, value));
+      auto [key, value] = *header;
+      r->headers.emplace(key, value);
+
+      // Reserve space for the body (Content-Length is a lower bound for
+      // compressed bodies), but don't trust servers with huge allocations.
+      size_t length = 0;
+      if (
+        header_name_equal(key, "Content-Length") &&
+        std::from_chars(value.data(), value.data() + value.size(), length)
+            .ec == std::errc())
+        r->body.reserve(std::min(length, max_body_reservation));
     }
     return real_size;
   }
 
+  struct CurlSlistDeleter
+  {
+    void operator()(curl_slist* l) const
+    {
+      curl_slist_free_all(l);
+    }
+  };
+
+  using UqCurlSlist = std::unique_ptr<curl_slist, CurlSlistDeleter>;
+
+  static UqCurlSlist header_list(
+    const std::unordered_map<std::string, std::string>& headers)
+  {
+    curl_slist* r = nullptr;
+    for (const auto& [k, v] : headers)
+    {
+      auto t = curl_slist_append(r, fmt::format("{}: {}", k, v).c_str());
+      if (!t)
+      {
+        curl_slist_free_all(r);
+        throw std::bad_alloc();
+      }
+      r = t;
+    }
+    return UqCurlSlist(r);
+  }
+
   static CURL* easy_setup(
     CURL* curl,
     const std::string& url,
     const std::string& body,
+    const UqCurlSlist& headers,
     HTTPResponse& r,
     size_t timeout,
-    bool verbose)
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression)
   {
+    // HTTP/2 is negotiated via ALPN (falling back to HTTP/1.1) for https URLs.
+    curl_easy_setopt(
+      curl,
+      CURLOPT_HTTP_VERSION,
+      http2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1);
+    // An empty list accepts all encodings supported by libcurl (gzip, br,
+    // zstd, ...); bodies are decoded before they reach body_write_fun.
+    curl_easy_setopt(
+      curl, CURLOPT_ACCEPT_ENCODING, compression ? "" : nullptr);
+    curl_easy_setopt(curl, CURLOPT_SHARE, curl_share());
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long)connection_idle_timeout);
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, body_write_fun);
@@ -74,383 +374,1442 @@ namespace ravl
     if (!body.empty())
       curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data());
 
+    if (headers)
+      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers.get());
+
     return curl;
   }
 
-  static bool must_retry(
-    CURL* curl, size_t id, size_t i, HTTPResponse& response, bool verbose)
+  static bool is_transient(CURLcode result)
+  {
+    switch (result)
+    {
+      case CURLE_COULDNT_RESOLVE_HOST:
+      case CURLE_COULDNT_CONNECT:
+      case CURLE_OPERATION_TIMEDOUT:
+      case CURLE_SSL_CONNECT_ERROR:
+      case CURLE_SEND_ERROR:
+      case CURLE_RECV_ERROR:
+      case CURLE_GOT_NOTHING:
+      case CURLE_PARTIAL_FILE:
+      case CURLE_HTTP2:
+      case CURLE_HTTP2_STREAM:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  static bool is_transient(long status)
+  {
+    return status == 429 || status == 500 || status == 502 || status == 503 ||
+      status == 504;
+  }
+
+  // Returns the delay after which a request should be retried (see
+  // http_policy.h), or nullopt if it should not be retried. Sets the response
+  // status.
+  static std::optional<std::chrono::milliseconds> retry_delay(
+    CURL* curl,
+    CURLcode result,
+    HTTPResponse& response,
+    size_t attempt,
+    size_t timeout)
+  {
+    if (result != CURLE_OK)
+    {
+      response.status = 0;
+      if (is_transient(result))
+        return retry_backoff_delay(attempt);
+      return std::nullopt;
+    }
+
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    response.status = status;
+
+    if (!is_transient(status))
+      return std::nullopt;
+
+    std::optional<std::chrono::seconds> retry_after = std::nullopt;
+#if LIBCURL_VERSION_NUM >= 0x074200 // CURLINFO_RETRY_AFTER is new in 7.66.0
+    curl_off_t ra = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &ra) == CURLE_OK)
+      retry_after = std::chrono::seconds(ra);
+#else
+    if (auto value = response.find_header("Retry-After"))
+      retry_after = parse_retry_after(*value);
+#endif
+
+    if (retry_after && retry_after->count() > 0)
+      return cap_retry_after(*retry_after, timeout);
+
+    return retry_backoff_delay(attempt);
+  }
+
+  static std::string retry_reason(CURLcode result, const HTTPResponse& r)
+  {
+    if (result != CURLE_OK)
+      return fmt::format("curl error: {}", curl_easy_strerror(result));
+    return fmt::format("HTTP {}", r.status);
+  }
+
+  // "host:port" of a URL
+  static std::string host_of(const std::string& url)
+  {
+    std::string r;
+    CURLU* u = curl_url();
+    if (u && curl_url_set(u, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK)
+    {
+      char* host = nullptr;
+      char* port = nullptr;
+      if (
+        curl_url_get(u, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) ==
+          CURLUE_OK)
+        r = fmt::format("{}:{}", host, port);
+      curl_free(host);
+      curl_free(port);
+    }
+    curl_url_cleanup(u);
+    return r;
+  }
+
+  static LatencyTracker& latency_tracker()
+  {
+    static LatencyTracker tracker;
+    return tracker;
+  }
+
+  static LatencyTracker::Duration total_time(CURL* curl)
+  {
+    curl_off_t us = 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &us);
+    return LatencyTracker::Duration(us);
+  }
+
+  static struct
+  {
+    std::atomic<uint64_t> responses = 0;
+    std::atomic<uint64_t> wire_bytes = 0;
+    std::atomic<uint64_t> body_bytes = 0;
+  } transfer_statistics;
+
+  static void record_transfer(CURL* curl, const HTTPResponse& response)
+  {
+    curl_off_t wire = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+    transfer_statistics.responses++;
+    transfer_statistics.wire_bytes += wire;
+    transfer_statistics.body_bytes += response.body.size();
+  }
+
+  HTTPTransferStatistics http_transfer_statistics()
+  {
+    HTTPTransferStatistics r;
+    r.responses = transfer_statistics.responses;
+    r.wire_bytes = transfer_statistics.wire_bytes;
+    r.body_bytes = transfer_statistics.body_bytes;
+    return r;
+  }
+
+  // Candidate URLs of a request (its URL and its mirrors), fastest first
+  static std::vector<std::string> candidate_urls(const HTTPRequest& request)
+  {
+    if (request.mirrors.empty())
+      return {request.url};
+
+    std::vector<std::string> urls = {request.url};
+    urls.insert(urls.end(), request.mirrors.begin(), request.mirrors.end());
+    return latency_tracker().order(std::move(urls), host_of);
+  }
+
+  static HTTPResponse execute_url(
+    EasyHandlePool& pool,
+    const std::string& url,
+    const HTTPRequest& request,
+    size_t timeout,
+    size_t max_attempts,
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression);
+
+  HTTPResponse SynchronousHTTPClient::execute_synchronous(
+    const HTTPRequest& request,
+    size_t timeout,
+    size_t max_attempts,
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression)
+  {
+    auto& pool = synchronous_pool();
+
+    auto urls = candidate_urls(request);
+
+    // Fail over to the next mirror (retrying only on the last one) if a
+    // request fails.
+    for (size_t i = 0;; i++)
+    {
+      bool last = i + 1 == urls.size();
+      try
+      {
+        auto r = execute_url(
+          pool,
+          urls[i],
+          request,
+          timeout,
+          last ? max_attempts : 1,
+          verbose,
+          connection_idle_timeout,
+          http2,
+          compression);
+        if (r.status < 400 || last)
+          return r;
+      }
+      catch (...)
+      {
+        if (last)
+          throw;
+      }
+
+      if (verbose)
+        log(fmt::format(
+          "Request {}: failed; trying mirror {}", urls[i], urls[i + 1]));
+    }
+  }
+
+  static HTTPResponse execute_url(
+    EasyHandlePool& pool,
+    const std::string& url,
+    const HTTPRequest& request,
+    size_t timeout,
+    size_t max_attempts,
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression)
+  {
+    auto headers = header_list(request.headers);
+
+    EasyHandleGuard handles(pool);
+    CURL* curl = handles.acquire();
+
+    HTTPResponse response;
+
+    for (size_t attempt = 1;; attempt++)
+    {
+      response = {};
+
+      easy_setup(
+        curl,
+        url,
+        request.body,
+        headers,
+        response,
+        timeout,
+        verbose,
+        connection_idle_timeout,
+        http2,
+        compression);
+
+      CURLcode curl_code = curl_easy_perform(curl);
+
+      auto delay = retry_delay(curl, curl_code, response, attempt, timeout);
+
+      if (curl_code == CURLE_OK)
+        record_transfer(curl, response);
+
+      if (curl_code == CURLE_OK && response.status < 400)
+        latency_tracker().record(host_of(url), total_time(curl));
+      else
+        latency_tracker().record_failure(host_of(url));
+
+      if (!delay)
+      {
+        if (curl_code != CURLE_OK)
+          throw std::runtime_error(fmt::format("curl error: {}", curl_code));
+        return response;
+      }
+
+      if (attempt >= max_attempts)
+        throw std::runtime_error(fmt::format(
+          "maxmimum number ({}) of URL request retries exceeded for {}",
+          max_attempts,
+          url));
+
+      if (verbose)
+        log(fmt::format(
+          "Request {}: {}; RETRY in {}ms",
+          url,
+          retry_reason(curl_code, response),
+          delay->count()));
+
+      std::this_thread::sleep_for(*delay);
+    }
+  }
+
+  // A request of a set that is executed concurrently; the same policies as
+  // for single requests apply (see execute_synchronous and execute_url).
+  struct SynchronousTransfer
+  {
+    std::vector<std::string> urls = {};
+    size_t url = 0;
+    size_t attempt = 1;
+    CURL* easy = nullptr;
+    UqCurlSlist headers = nullptr;
+    HTTPResponse response = {};
+    std::optional<std::chrono::steady_clock::time_point> due = std::nullopt;
+    std::exception_ptr error = nullptr;
+    bool done = false;
+  };
+
+  HTTPResponses SynchronousHTTPClient::execute_synchronous(
+    const HTTPRequests& requests,
+    size_t timeout,
+    size_t max_attempts,
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression)
+  {
+    using Clock = std::chrono::steady_clock;
+
+    if (requests.size() == 1)
+      return {execute_synchronous(
+        requests[0],
+        timeout,
+        max_attempts,
+        verbose,
+        connection_idle_timeout,
+        http2,
+        compression)};
+
+    static MultiHandlePool multi_pool;
+    auto& pool = synchronous_pool();
+
+    // Declared before the handles, so that the header lists outlive them.
+    std::vector<SynchronousTransfer> transfers(requests.size());
+    size_t remaining = transfers.size();
+
+    MultiHandleGuard multi_handle(multi_pool);
+    CURLM* multi = multi_handle.multi;
+    curl_multi_setopt(
+      multi,
+      CURLMOPT_PIPELINING,
+      http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    EasyHandleGuard handles(pool, multi);
+
+    auto start = [&](size_t i) {
+      auto& t = transfers[i];
+      const auto& url = t.urls[t.url];
+      t.response = {};
+      t.due = std::nullopt;
+      easy_setup(
+        t.easy,
+        url,
+        requests[i].body,
+        t.headers,
+        t.response,
+        timeout,
+        verbose,
+        connection_idle_timeout,
+        http2,
+        compression);
+      curl_easy_setopt(t.easy, CURLOPT_PRIVATE, &t);
+      if (http2 && url.starts_with("https://"))
+        curl_easy_setopt(t.easy, CURLOPT_PIPEWAIT, 1L);
+      curl_multi_add_handle(multi, t.easy);
+    };
+
+    auto finish = [&](SynchronousTransfer& t, std::exception_ptr error) {
+      t.error = error;
+      t.done = true;
+      remaining--;
+    };
+
+    auto complete = [&](SynchronousTransfer& t, CURLcode result) {
+      const auto& url = t.urls[t.url];
+      bool last = t.url + 1 == t.urls.size();
+
+      auto delay = retry_delay(t.easy, result, t.response, t.attempt, timeout);
+
+      if (result == CURLE_OK)
+        record_transfer(t.easy, t.response);
+
+      bool ok = result == CURLE_OK && t.response.status < 400;
+      if (ok)
+        latency_tracker().record(host_of(url), total_time(t.easy));
+      else
+        latency_tracker().record_failure(host_of(url));
+
+      // Fail over to the next mirror (retrying only on the last one).
+      if (!ok && !last)
+      {
+        if (verbose)
+          log(fmt::format(
+            "Request {}: failed; trying mirror {}", url, t.urls[t.url + 1]));
+        t.url++;
+        t.attempt = 1;
+        t.due = Clock::now();
+      }
+      else if (!delay)
+      {
+        if (result != CURLE_OK)
+          finish(
+            t,
+            std::make_exception_ptr(
+              std::runtime_error(fmt::format("curl error: {}", result))));
+        else
+          finish(t, nullptr);
+      }
+      else if (t.attempt >= max_attempts)
+        finish(
+          t,
+          std::make_exception_ptr(std::runtime_error(fmt::format(
+            "maxmimum number ({}) of URL request retries exceeded for {}",
+            max_attempts,
+            url))));
+      else
+      {
+        if (verbose)
+          log(fmt::format(
+            "Request {}: {}; RETRY in {}ms",
+            url,
+            retry_reason(result, t.response),
+            delay->count()));
+        t.attempt++;
+        t.due = Clock::now() + *delay;
+      }
+    };
+
+    for (size_t i = 0; i < transfers.size(); i++)
+    {
+      transfers[i].urls = candidate_urls(requests[i]);
+      transfers[i].headers = header_list(requests[i].headers);
+      transfers[i].easy = handles.acquire();
+      start(i);
+    }
+
+    while (remaining > 0)
+    {
+      int running = 0;
+      curl_multi_perform(multi, &running);
+
+      CURLMsg* msg = nullptr;
+      int msgs_left = 0;
+      while ((msg = curl_multi_info_read(multi, &msgs_left)))
+      {
+        if (msg->msg != CURLMSG_DONE)
+          continue;
+        SynchronousTransfer* t = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &t);
+        CURLcode result = msg->data.result;
+        curl_multi_remove_handle(multi, msg->easy_handle);
+        complete(*t, result);
+      }
+
+      // Start due retries, and wait for the next one (or network activity).
+      auto now = Clock::now();
+      std::optional<Clock::time_point> next_due = std::nullopt;
+      for (size_t i = 0; i < transfers.size(); i++)
+      {
+        auto& t = transfers[i];
+        if (t.done || !t.due)
+          continue;
+        if (*t.due <= now)
+          start(i);
+        else if (!next_due || *t.due < *next_due)
+          next_due = t.due;
+      }
+
+      if (remaining == 0)
+        break;
+
+      int wait_ms = 1000;
+      if (next_due)
+        wait_ms = std::chrono::ceil<std::chrono::milliseconds>(*next_due - now)
+                    .count();
+      curl_multi_poll(multi, nullptr, 0, wait_ms, nullptr);
+    }
+
+    HTTPResponses r;
+    r.reserve(transfers.size());
+    for (auto& t : transfers)
+    {
+      if (t.error)
+        std::rethrow_exception(t.error);
+      r.push_back(std::move(t.response));
+    }
+    return r;
+  }
+
+  // Timer wheel for scheduling items (e.g. retries) at (coarse) future points
+  // in time. Scheduling is O(1), and taking the due items is O(1) per elapsed
+  // tick and item; items further out than a full revolution stay in their
+  // slot until their tick comes around.
+  template <typename T>
+  class TimerWheel
+  {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    TimerWheel(Clock::duration resolution_, size_t num_slots) :
+      resolution(resolution_),
+      slots(num_slots),
+      origin(Clock::now())
+    {}
+
+    virtual ~TimerWheel() = default;
+
+    /// Schedule an item (items in the past are due at the next tick)
+    void schedule(Clock::time_point deadline, T item)
+    {
+      uint64_t tick = 0;
+      if (deadline > origin)
+      {
+        auto d = (deadline - origin).count();
+        auto r = resolution.count();
+        tick = (d + r - 1) / r;
+      }
+      tick = std::max(tick, cursor);
+      slots[tick % slots.size()].push_back({tick, std::move(item)});
+      count++;
+    }
+
+    /// Take all items that are due at time `now`
+    std::vector<T> take_due(Clock::time_point now)
+    {
+      std::vector<T> r;
+
+      uint64_t now_tick = now <= origin ? 0 : (now - origin) / resolution;
+      if (now_tick < cursor)
+        return r;
+
+      if (count > 0)
+      {
+        uint64_t n = std::min<uint64_t>(now_tick - cursor + 1, slots.size());
+        for (uint64_t t = cursor; t < cursor + n; t++)
+        {
+          auto& slot = slots[t % slots.size()];
+          for (auto it = slot.begin(); it != slot.end();)
+          {
+            if (it->first <= now_tick)
+            {
+              r.push_back(std::move(it->second));
+              it = slot.erase(it);
+              count--;
+            }
+            else
+              it++;
+          }
+        }
+      }
+
+      cursor = now_tick + 1;
+      return r;
+    }
+
+    /// Time at which the next item becomes due
+    std::optional<Clock::time_point> next_deadline() const
+    {
+      if (count == 0)
+        return std::nullopt;
+
+      for (uint64_t t = cursor; t < cursor + slots.size(); t++)
+        for (const auto& [tick, item] : slots[t % slots.size()])
+          if (tick == t)
+            return origin + t * resolution;
+
+      uint64_t min_tick = UINT64_MAX;
+      for (const auto& slot : slots)
+        for (const auto& [tick, item] : slot)
+          min_tick = std::min(min_tick, tick);
+      return origin + min_tick * resolution;
+    }
+
+    /// Number of scheduled items
+    size_t size() const
+    {
+      return count;
+    }
+
+  protected:
+    Clock::duration resolution;
+    std::vector<std::list<std::pair<uint64_t, T>>> slots;
+    Clock::time_point origin;
+    uint64_t cursor = 0;
+    size_t count = 0;
+  };
+
+  // Asynchronous client with a single event loop ("reactor") thread that
+  // drives one shared curl multi handle via curl_multi_socket_action and
+  // epoll. Responses are delivered per request set, from the reactor thread.
+  class CurlClient : public HTTPClient
   {
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
-
-    if (response.status == 429)
+  public:
+    CurlClient(
+      size_t request_timeout_,
+      size_t max_attempts_,
+      bool verbose_,
+      size_t connection_idle_timeout_,
+      bool http2_,
+      bool compression_,
+      const HTTPHostLimits& host_limits_) :
+      HTTPClient(
+        request_timeout_,
+        max_attempts_,
+        verbose_,
+        connection_idle_timeout_,
+        http2_,
+        compression_),
+      host_limits(host_limits_)
     {
-      long retry_after = 0;
-      try
+      curl_share();
+
+      multi = curl_multi_init();
+      if (!multi)
+        throw std::bad_alloc();
+
+      epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+      event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (epoll_fd == -1 || event_fd == -1)
       {
-#ifdef CURLINFO_RETRY_AFTER
-        curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
-#else
-        auto ra = response.get_header_string("Retry-After");
-        retry_after = std::atol(ra.c_str());
-        if (retry_after == 0)
-          throw std::runtime_error(
-            "could not convert retry-after header value");
-#endif
+        cleanup();
+        throw std::runtime_error("could not create reactor file descriptors");
       }
-      catch (...)
+
+      epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = event_fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) == -1)
       {
-        log("caught exception while extracting retry-after header");
-        return false;
+        cleanup();
+        throw std::runtime_error("could not register reactor event");
       }
-      if (verbose)
-        log(fmt::format(
-          "Request {}:{}: HTTP 429; RETRY after {}s", id, i, retry_after));
-      std::this_thread::sleep_for(std::chrono::seconds(retry_after));
-      response.body = "";
-      response.headers.clear();
-      response.status = 0;
-      return true;
-    }
-    else
-      return false;
-  }
 
-  HTTPResponse SynchronousHTTPClient::execute_synchronous(
-    const HTTPRequest& request,
-    size_t timeout,
-    size_t max_attempts,
-    bool verbose)
-  {
-    const size_t max_attempts_in = max_attempts;
+      curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+      curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+      curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+      curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+      curl_multi_setopt(
+        multi,
+        CURLMOPT_PIPELINING,
+        http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+      curl_multi_setopt(
+        multi,
+        CURLMOPT_MAX_HOST_CONNECTIONS,
+        (long)host_limits.max_connections);
+
+      reactor = std::thread(&CurlClient::run, this);
+    }
 
-    if (!initialized)
+    virtual ~CurlClient()
     {
-      curl_global_init(CURL_GLOBAL_ALL);
-      atexit(curl_global_cleanup);
-      initialized = true;
-    }
+      stop = true;
+      wake();
+      reactor.join();
+
+      for (auto& [easy, transfer] : transfers)
+      {
+        curl_multi_remove_handle(multi, easy);
+        curl_easy_cleanup(easy);
+      }
+      transfers.clear();
 
-    CURL* curl = curl_easy_init();
+      for (auto& t : new_transfers)
+        curl_easy_cleanup(t.easy);
+      new_transfers.clear();
 
-    if (!curl)
-      throw std::runtime_error("libcurl initialization failed");
+      // Pooled handles go before the multi handle (and its connections).
+      pool.reset();
 
-    HTTPResponse response;
+      cleanup();
+    }
 
-    while (max_attempts > 0)
+    HTTPRequestSetId submit(
+      HTTPRequests&& rs, std::function<void(HTTPResponses&&)>&& callback)
     {
-      easy_setup(curl, request.url, request.body, response, timeout, verbose);
+      auto set = std::make_shared<RequestSet>();
+      set->requests = std::move(rs);
+      set->responses.resize(set->requests.size());
+      set->pending.resize(set->requests.size());
+      set->outstanding = set->requests.size();
+      set->callback = std::move(callback);
 
-      CURLcode curl_code = curl_easy_perform(curl);
+      std::vector<Transfer> ts;
 
-      if (curl_code != CURLE_OK)
-      {
-        curl_easy_cleanup(curl);
-        throw std::runtime_error(fmt::format("curl error: {}", curl_code));
-      }
-      else
+      for (size_t i = 0; i < set->requests.size(); i++)
       {
-        if (must_retry(curl, 0, 0, response, verbose))
-          max_attempts--;
-        else
+        set->pending[i].urls = candidate_urls(set->requests[i]);
+        try
+        {
+          ts.push_back(make_transfer(set, i, set->pending[i].urls[0]));
+        }
+        catch (...)
         {
-          curl_easy_cleanup(curl);
-          return response;
+          for (auto& t : ts)
+            pool->release(t.easy);
+          throw;
         }
       }
-    }
-
-    if (curl)
-      curl_easy_cleanup(curl);
-
-    throw std::runtime_error(fmt::format(
-      "maxmimum number ({}) of URL request retries exceeded for {}",
-      max_attempts_in,
-      request.url));
-  }
 
-  class CurlClient : public HTTPClient
-  {
-  public:
-    CurlClient(size_t request_timeout_, size_t max_attempts_, bool verbose_) :
-      HTTPClient(request_timeout_, max_attempts_, verbose_)
-    {}
-
-    virtual ~CurlClient() {}
+      HTTPRequestSetId id;
+      bool empty = set->requests.empty();
 
-    class MonitorThread
-    {
-    public:
-      MonitorThread(
-        CurlClient* client_,
-        HTTPRequestSetId id_,
-        CURLM* multi_,
-        std::function<void(HTTPResponses&&)> callback_) :
-        keep_going(true),
-        client(client_),
-        id(id_),
-        multi(multi_),
-        callback(callback_)
       {
-        std::thread(&MonitorThread::run, this).detach();
+        std::lock_guard<std::mutex> guard(mtx);
+        id = next_id++;
+        set->id = id;
+        if (!empty || !set->callback)
+          sets.emplace(id, set);
+        for (auto& t : ts)
+          new_transfers.push_back(std::move(t));
       }
 
-      virtual ~MonitorThread()
+      if (empty)
       {
-        stop();
+        if (set->callback)
+          set->callback(std::move(set->responses));
       }
+      else
+        wake();
+
+      return id;
+    }
+
+    bool is_complete(const HTTPRequestSetId& id) const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
 
-      void stop()
+      // Sets with callbacks are forgotten once they are complete.
+      auto sit = sets.find(id);
+      return sit == sets.end() || sit->second->outstanding == 0;
+    }
+
+    void erase(const HTTPRequestSetId& id)
+    {
       {
-        keep_going = false;
+        std::lock_guard<std::mutex> guard(mtx);
+
+        auto sit = sets.find(id);
+        if (sit == sets.end())
+          return;
+
+        sit->second->cancelled = true;
+        sets.erase(sit);
+        cancellations = true;
       }
 
-      void run()
+      wake();
+    }
+
+    std::unordered_map<std::string, HTTPHostStatistics> host_statistics()
+      const
+    {
+      std::lock_guard<std::mutex> guard(hosts_mtx);
+
+      std::unordered_map<std::string, HTTPHostStatistics> r;
+      for (const auto& [key, host] : hosts)
       {
-        while (keep_going)
-          keep_going = client->poll(id, multi, callback);
-        curl_multi_cleanup(multi);
+        auto& s = r[key];
+        s.queue_depth = host.queue.size();
+        s.active = host.active;
+        s.requests = host.requests;
+        s.rejected = host.rejected;
+        s.throttled = host.throttled;
+        s.throttled_time =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            host.throttled_time);
+        s.latency_ewma = latency_tracker().ewma(key).value_or(
+          std::chrono::microseconds(0));
+        s.latency_p95 = latency_tracker().p95(key).value_or(
+          std::chrono::microseconds(0));
       }
+      return r;
+    }
 
-    protected:
-      bool keep_going = true;
+  protected:
+    // State of a request that may be sent to several mirrors (only used by
+    // the reactor thread once the request set has been submitted)
+    struct PendingRequest
+    {
+      /// Candidate URLs, fastest first
+      std::vector<std::string> urls;
 
-      CurlClient* client;
-      HTTPRequestSetId id;
-      CURLM* multi;
+      /// Index of the next candidate to try
+      size_t next_url = 1;
+
+      /// Transfers in flight
+      std::vector<CURL*> easies;
+
+      bool done = false;
+    };
+
+    struct RequestSet
+    {
+      HTTPRequestSetId id = 0;
+      HTTPRequests requests;
+      HTTPResponses responses;
+      std::vector<PendingRequest> pending;
       std::function<void(HTTPResponses&&)> callback;
+      size_t outstanding = 0;
+
+      // Set by erase() (under mtx), read by the reactor thread
+      std::atomic<bool> cancelled = false;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    // Per-host request queue, token bucket and statistics
+    struct Host
+    {
+      std::deque<CURL*> queue;
+      size_t active = 0;
+      TokenBucket bucket;
+      Clock::time_point paused_until;
+
+      uint64_t requests = 0;
+      uint64_t rejected = 0;
+      uint64_t throttled = 0;
+      Clock::duration throttled_time = {};
     };
 
-    void consume_msgs(HTTPRequestSetId id, CURLM* multi)
+    struct Transfer
     {
-      struct CURLMsg* m;
-      do
-      {
-        int msgq = 0;
-        m = curl_multi_info_read(multi, &msgq);
-        if (m && m->msg == CURLMSG_DONE)
-        {
-          size_t i = 0;
-          if (
-            curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, &i) == CURLE_OK)
-            complete(id, i, m->easy_handle);
-        }
-      } while (m);
+      std::shared_ptr<RequestSet> set;
+      size_t index = 0;
+      CURL* easy = nullptr;
+      std::unique_ptr<HTTPResponse> response;
+      UqCurlSlist headers;
+      size_t attempts = 1;
+      uint64_t retry_ticket = 0;
+      uint64_t hedge_ticket = 0;
+      std::string host_key;
+      Host* host = nullptr;
+      bool queued = false;
+      bool active = false;
+    };
+
+    struct Timer
+    {
+      CURL* easy = nullptr;
+      uint64_t ticket = 0;
+      bool hedge = false;
+    };
+
+    using Transfers = std::unordered_map<CURL*, Transfer>;
+
+    CURLM* multi = nullptr;
+    int epoll_fd = -1;
+    int event_fd = -1;
+    std::thread reactor;
+    std::atomic<bool> stop = false;
+    std::unique_ptr<EasyHandlePool> pool = std::make_unique<EasyHandlePool>();
+    HTTPHostLimits host_limits;
+
+    // Written by the reactor thread only, protected by hosts_mtx (for reading
+    // statistics)
+    mutable std::mutex hosts_mtx;
+    std::unordered_map<std::string, Host> hosts;
+
+    // Protected by mtx
+    mutable std::mutex mtx;
+    HTTPRequestSetId next_id = 0;
+    std::unordered_map<HTTPRequestSetId, std::shared_ptr<RequestSet>> sets;
+    std::vector<Transfer> new_transfers;
+    bool cancellations = false;
+
+    // Only used by the reactor thread
+    Transfers transfers;
+    TimerWheel<Timer> timers =
+      TimerWheel<Timer>(std::chrono::milliseconds(10), 4096);
+    uint64_t next_ticket = 1;
+    std::optional<Clock::time_point> timer_deadline;
+    std::optional<Clock::time_point> dispatch_deadline;
+
+    void cleanup()
+    {
+      if (event_fd != -1)
+        close(event_fd);
+      if (epoll_fd != -1)
+        close(epoll_fd);
+      if (multi)
+        curl_multi_cleanup(multi);
+      event_fd = epoll_fd = -1;
+      multi = nullptr;
+    }
+
+    void wake()
+    {
+      uint64_t one = 1;
+      if (write(event_fd, &one, sizeof(one)) != sizeof(one) && verbose)
+        log("could not wake up HTTP client reactor");
     }
 
-    bool poll(
-      HTTPRequestSetId id,
-      CURLM* multi,
-      std::function<void(HTTPResponses&&)>& callback)
+    static int socket_callback(
+      CURL*, curl_socket_t s, int what, void* userp, void* socketp)
     {
-      if (!is_complete(id))
+      auto client = static_cast<CurlClient*>(userp);
+
+      if (what == CURL_POLL_REMOVE)
       {
-        std::lock_guard<std::mutex> guard(mtx);
-        int num_active_fds = 0;
-        CURLMcode mc = curl_multi_wait(multi, NULL, 0, 100, &num_active_fds);
-        if (mc != CURLM_OK)
-          throw std::runtime_error("curl_multi_wait failed");
-        consume_msgs(id, multi);
-        return true;
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+        return 0;
       }
 
-      std::lock_guard<std::mutex> guard(mtx);
+      epoll_event ev = {};
+      ev.data.fd = s;
+      if (what & CURL_POLL_IN)
+        ev.events |= EPOLLIN;
+      if (what & CURL_POLL_OUT)
+        ev.events |= EPOLLOUT;
 
-      if (callback)
+      int op = socketp ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+      if (epoll_ctl(client->epoll_fd, op, s, &ev) == -1)
       {
-        consume_msgs(id, multi);
-        auto rsps_it = responses.find(id);
-        if (rsps_it == responses.end())
-          throw std::runtime_error("could not find url responses");
-        HTTPResponses rs;
-        rs.swap(rsps_it->second);
-        callback(std::move(rs));
-        responses.erase(rsps_it);
-        requests.erase(id);
+        // The socket may have been closed and its descriptor reused.
+        op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(client->epoll_fd, op, s, &ev) == -1)
+          return -1;
       }
 
-      auto mtit = monitor_threads.find(id);
-      if (mtit != monitor_threads.end())
-        mtit->second->stop();
+      if (!socketp)
+        curl_multi_assign(client->multi, s, client);
 
-      return false;
+      return 0;
     }
 
-    HTTPRequestSetId submit(
-      HTTPRequests&& rs, std::function<void(HTTPResponses&&)>&& callback)
+    static int timer_callback(CURLM*, long timeout_ms, void* userp)
     {
-      std::lock_guard<std::mutex> guard(mtx);
+      auto client = static_cast<CurlClient*>(userp);
+      if (timeout_ms < 0)
+        client->timer_deadline = std::nullopt;
+      else
+        client->timer_deadline =
+          Clock::now() + std::chrono::milliseconds(timeout_ms);
+      return 0;
+    }
+
+    int epoll_timeout() const
+    {
+      std::optional<Clock::time_point> deadline = timer_deadline;
+      for (auto d : {timers.next_deadline(), dispatch_deadline})
+        if (d && (!deadline || *d < *deadline))
+          deadline = d;
+
+      if (!deadline)
+        return -1;
+
+      auto now = Clock::now();
+      if (*deadline <= now)
+        return 0;
+
+      auto ms =
+        std::chrono::ceil<std::chrono::milliseconds>(*deadline - now).count();
+      return static_cast<int>(std::min<int64_t>(ms, INT32_MAX));
+    }
+
+    void run()
+    {
+      static constexpr int max_events = 64;
+      epoll_event events[max_events];
 
-      if (!initialized)
+      while (!stop)
       {
-        curl_global_init(CURL_GLOBAL_ALL);
-        atexit(curl_global_cleanup);
-        initialized = true;
-      }
+        add_new_transfers();
+        add_due_timers();
+        dispatch();
 
-      HTTPRequestSetId id = requests.size();
-      auto [it, ok] = requests.emplace(id, TrackedRequests{std::move(rs)});
-      if (!ok)
-        throw std::bad_alloc();
+        int n = epoll_wait(epoll_fd, events, max_events, epoll_timeout());
+        if (n == -1 && errno != EINTR)
+        {
+          log(fmt::format("epoll_wait failed: {}", strerror(errno)));
+          break;
+        }
 
-      TrackedRequests& reqs = it->second;
+        int running = 0;
 
-      CURLM* multi = curl_multi_init();
+        for (int i = 0; i < n; i++)
+        {
+          int fd = events[i].data.fd;
+          if (fd == event_fd)
+          {
+            uint64_t count;
+            while (read(event_fd, &count, sizeof(count)) > 0)
+              ;
+            continue;
+          }
+
+          int flags = 0;
+          if (events[i].events & EPOLLIN)
+            flags |= CURL_CSELECT_IN;
+          if (events[i].events & EPOLLOUT)
+            flags |= CURL_CSELECT_OUT;
+          if (events[i].events & (EPOLLERR | EPOLLHUP))
+            flags |= CURL_CSELECT_ERR;
+          curl_multi_socket_action(multi, fd, flags, &running);
+        }
 
-      if (!multi)
-        throw std::bad_alloc();
+        if (timer_deadline && *timer_deadline <= Clock::now())
+        {
+          timer_deadline = std::nullopt;
+          curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
 
-      reqs.multi = multi;
+        consume_msgs();
+      }
+    }
 
-      auto [rsps_it, rsps_ok] =
-        responses.emplace(id, HTTPResponses(reqs.requests.size()));
-      if (!rsps_ok)
-        throw std::bad_alloc();
+    Transfer make_transfer(
+      const std::shared_ptr<RequestSet>& set,
+      size_t index,
+      const std::string& url)
+    {
+      Transfer t;
+      t.set = set;
+      t.index = index;
+      t.response = std::make_unique<HTTPResponse>();
+      t.headers = header_list(set->requests[index].headers);
+      t.host_key = host_of(url);
+      t.easy = pool->acquire();
+      easy_setup(
+        t.easy,
+        url,
+        set->requests[index].body,
+        t.headers,
+        *t.response,
+        request_timeout,
+        verbose,
+        connection_idle_timeout,
+        http2,
+        compression);
+      // Wait for a connection to the same host that may be multiplexed,
+      // instead of opening a new one. (HTTP/2 is only negotiated over TLS;
+      // waiting for plain HTTP/1.1 connections serializes requests.)
+      if (http2 && url.starts_with("https://"))
+        curl_easy_setopt(t.easy, CURLOPT_PIPEWAIT, 1L);
+      return t;
+    }
 
-      std::vector<CURL*> easies;
+    // Remove a transfer (requires hosts_mtx)
+    Transfers::iterator cancel(Transfers::iterator it)
+    {
+      auto& t = it->second;
+      if (t.active)
+      {
+        curl_multi_remove_handle(multi, it->first);
+        t.host->active--;
+      }
+      else if (t.queued)
+        std::erase(t.host->queue, it->first);
+      std::erase(t.set->pending[t.index].easies, it->first);
+      pool->release(it->first);
+      return transfers.erase(it);
+    }
+
+    // Queue a transfer for its host; returns false if the queue is full.
+    bool enqueue(Transfer&& t)
+    {
+      std::lock_guard<std::mutex> guard(hosts_mtx);
+
+      auto [hit, added] = hosts.try_emplace(t.host_key);
+      auto& host = hit->second;
+      if (added)
+        host.bucket =
+          TokenBucket(host_limits.requests_per_second, host_limits.burst);
 
-      for (size_t i = 0; i < reqs.requests.size(); i++)
+      if (
+        host_limits.max_queue_depth != 0 &&
+        host.queue.size() >= host_limits.max_queue_depth)
       {
-        auto& request = reqs.requests.at(i);
-        CURL* easy = curl_easy_init();
-        if (!easy)
-          throw std::bad_alloc();
-        HTTPResponse& response = rsps_it->second[i];
-        easy_setup(
-          easy, request.url, request.body, response, request_timeout, verbose);
-        curl_easy_setopt(easy, CURLOPT_PRIVATE, i);
-        curl_multi_add_handle(multi, easy);
-        easies.push_back(easy);
+        if (verbose)
+          log(fmt::format(
+            "Request {}:{}: rejected, queue for {} is full",
+            t.set->id,
+            t.index,
+            t.host_key));
+        host.rejected++;
+        pool->release(t.easy);
+        return false;
       }
 
-      int running_handles = 0;
-      CURLMcode curl_code = curl_multi_perform(multi, &running_handles);
+      auto easy = t.easy;
+      t.host = &host;
+      t.queued = true;
+      host.queue.push_back(easy);
+      t.set->pending[t.index].easies.push_back(easy);
+      transfers.emplace(easy, std::move(t));
+      return true;
+    }
+
+    void add_new_transfers()
+    {
+      std::vector<Transfer> ts;
+      bool cancel_sets = false;
 
-      if (curl_code != CURLM_OK)
       {
-        for (const auto& easy : easies)
+        std::lock_guard<std::mutex> guard(mtx);
+        ts.swap(new_transfers);
+        cancel_sets = cancellations;
+        cancellations = false;
+
+        if (cancel_sets)
         {
-          curl_multi_remove_handle(multi, easy);
-          curl_easy_cleanup(easy);
+          std::lock_guard<std::mutex> hguard(hosts_mtx);
+          for (auto it = transfers.begin(); it != transfers.end();)
+          {
+            if (it->second.set->cancelled)
+              it = cancel(it);
+            else
+              it++;
+          }
+        }
+
+        for (auto& t : ts)
+        {
+          if (t.set->cancelled)
+          {
+            pool->release(t.easy);
+            t.easy = nullptr;
+          }
         }
-        curl_multi_cleanup(multi);
-        throw std::runtime_error("curl_multi_perform unsuccessful");
       }
 
-      monitor_threads[id] =
-        std::make_shared<MonitorThread>(this, id, multi, callback);
+      for (auto& t : ts)
+      {
+        if (!t.easy)
+          continue;
 
-      return id;
+        auto set = t.set;
+        auto index = t.index;
+        if (!enqueue(std::move(t)))
+          failed(set, index, HTTPResponse());
+      }
     }
 
-    void complete(size_t id, size_t i, CURL* easy)
+    // Send the request to the next mirror.
+    void try_next_url(const std::shared_ptr<RequestSet>& set, size_t index)
     {
-      // Lock held by the monitor thread
-      auto rqit = requests.find(id);
-      if (rqit == requests.end())
-        return;
-
-      auto multi = rqit->second.multi;
+      auto& p = set->pending[index];
+      const auto& url = p.urls.at(p.next_url++);
 
-      auto rsit = responses.find(id);
-      if (rsit == responses.end())
-        throw std::runtime_error("response set not found");
+      if (verbose)
+        log(fmt::format("Request {}:{}: trying {}", set->id, index, url));
 
-      if (rsit->second.size() != rqit->second.requests.size())
-        rsit->second.resize(rqit->second.requests.size());
+      try
+      {
+        if (enqueue(make_transfer(set, index, url)))
+          return;
+      }
+      catch (const std::exception& ex)
+      {
+        log(fmt::format(
+          "Request {}:{}: could not create transfer: {}",
+          set->id,
+          index,
+          ex.what()));
+      }
 
-      if (i >= rsit->second.size())
-        throw std::runtime_error("request index too large");
+      failed(set, index, HTTPResponse());
+    }
 
-      HTTPResponse& response = rsit->second.at(i);
+    // A request has been answered successfully; cancel its other transfers.
+    void succeeded(
+      const std::shared_ptr<RequestSet>& set,
+      size_t index,
+      HTTPResponse&& response)
+    {
+      auto& p = set->pending[index];
+      if (p.done)
+        return;
+      p.done = true;
 
-      curl_multi_remove_handle(multi, easy);
-      if (must_retry(easy, id, i, response, true))
-        curl_multi_add_handle(multi, easy);
-      else
       {
-        curl_easy_cleanup(easy);
-        if (verbose)
-          log(fmt::format(
-            "Request {}:{}: complete: {} size {}",
-            id,
-            i,
-            response.status,
-            response.body.size()));
+        std::lock_guard<std::mutex> guard(hosts_mtx);
+        while (!p.easies.empty())
+        {
+          auto tit = transfers.find(p.easies.back());
+          if (tit != transfers.end())
+            cancel(tit);
+          else
+            p.easies.pop_back();
+        }
       }
+
+      set->responses.at(index) = std::move(response);
+      complete(set);
     }
 
-    bool is_complete(const HTTPRequestSetId& id) const
+    // A transfer for a request has failed; fail over to the next mirror,
+    // unless another transfer for the request is still in flight.
+    void failed(
+      const std::shared_ptr<RequestSet>& set,
+      size_t index,
+      HTTPResponse&& response)
     {
-      Requests::const_iterator rit = requests.end();
-      CURLMcode mc = CURLM_OK;
-      int still_running = 0;
-      CURLM* multi = NULL;
+      auto& p = set->pending[index];
+      if (p.done || !p.easies.empty())
+        return;
 
+      if (p.next_url < p.urls.size() && !set->cancelled)
       {
-        std::lock_guard<std::mutex> guard(mtx);
+        try_next_url(set, index);
+        return;
+      }
+
+      p.done = true;
+      set->responses.at(index) = std::move(response);
+      complete(set);
+    }
 
-        rit = requests.find(id);
-        if (rit == requests.end())
-          throw std::runtime_error("no such request set");
+    void add_due_timers()
+    {
+      for (const auto& timer : timers.take_due(Clock::now()))
+      {
+        // Skip timers of transfers that have completed or have been cancelled
+        // since (their handles may have been reused).
+        auto tit = transfers.find(timer.easy);
+        if (tit == transfers.end())
+          continue;
+
+        auto& t = tit->second;
+        if (timer.hedge)
+        {
+          auto& p = t.set->pending[t.index];
+          if (
+            t.hedge_ticket == timer.ticket && t.active && !p.done &&
+            p.next_url < p.urls.size())
+          {
+            if (verbose)
+              log(fmt::format(
+                "Request {}:{}: slower than usual; hedging",
+                t.set->id,
+                t.index));
+            t.hedge_ticket = 0;
+            try_next_url(t.set, t.index);
+          }
+        }
+        else if (t.retry_ticket == timer.ticket)
+        {
+          std::lock_guard<std::mutex> guard(hosts_mtx);
+          t.retry_ticket = 0;
+          t.queued = true;
+          t.host->queue.push_front(timer.easy);
+        }
+      }
+    }
 
-        multi = rit->second.multi;
-        mc = curl_multi_perform(multi, &still_running);
+    // Send queued requests, as far as the per-host limits allow.
+    void dispatch()
+    {
+      std::lock_guard<std::mutex> guard(hosts_mtx);
 
-        if (mc != CURLM_OK)
-          return true;
+      dispatch_deadline = std::nullopt;
+      auto wake_at = [this](Clock::time_point t) {
+        if (!dispatch_deadline || t < *dispatch_deadline)
+          dispatch_deadline = t;
+      };
 
-        if (still_running > 0)
-          return false;
+      auto now = Clock::now();
 
-        auto rsit = responses.find(id);
-        if (rsit == responses.end())
-          return false;
+      for (auto& [key, host] : hosts)
+      {
+        if (host.queue.empty())
+          continue;
 
-        for (size_t i = 0; i < rsit->second.size(); i++)
-          if (rsit->second[i].status == 0)
-            return false;
+        if (now < host.paused_until)
+        {
+          wake_at(host.paused_until);
+          continue;
+        }
 
-        return true;
+        while (!host.queue.empty())
+        {
+          if (
+            host_limits.max_connections != 0 &&
+            host.active >= host_limits.max_connections)
+            break;
+
+          if (!host.bucket.try_take(now))
+          {
+            wake_at(host.bucket.available_at());
+            break;
+          }
+
+          CURL* easy = host.queue.front();
+          host.queue.pop_front();
+
+          auto& t = transfers.at(easy);
+          t.queued = false;
+          t.active = true;
+          host.active++;
+          host.requests++;
+          curl_multi_add_handle(multi, easy);
+
+          // Hedge to the next mirror if this one takes longer than usual.
+          const auto& p = t.set->pending[t.index];
+          if (p.next_url < p.urls.size())
+          {
+            if (auto d = latency_tracker().p95(t.host_key))
+            {
+              t.hedge_ticket = next_ticket++;
+              timers.schedule(now + *d, Timer{easy, t.hedge_ticket, true});
+            }
+          }
+        }
       }
     }
 
-    void erase(const HTTPRequestSetId& id)
+    // Pause all requests to a host (after HTTP 429)
+    void pause(Host& host, Clock::time_point until)
     {
-      auto mtit = monitor_threads.find(id);
-      if (mtit != monitor_threads.end())
-        mtit->second->stop();
-      monitor_threads.erase(mtit);
-      requests.erase(id);
-      responses.erase(id);
-    }
+      std::lock_guard<std::mutex> guard(hosts_mtx);
 
-  protected:
-    mutable std::mutex mtx;
+      host.throttled++;
+      auto now = Clock::now();
+      if (until > host.paused_until)
+      {
+        host.throttled_time += until - std::max(host.paused_until, now);
+        host.paused_until = until;
+      }
+    }
 
-    struct TrackedRequests
+    void consume_msgs()
     {
-      HTTPRequests requests = {};
-      CURLM* multi = NULL;
-      std::function<void(HTTPResponses&&)> callback = nullptr;
-      size_t timeout = 0;
-    };
+      CURLMsg* m = nullptr;
+      int msgq = 0;
+      while ((m = curl_multi_info_read(multi, &msgq)))
+      {
+        if (m->msg != CURLMSG_DONE)
+          continue;
+
+        CURL* easy = m->easy_handle;
+        CURLcode result = m->data.result;
+        curl_multi_remove_handle(multi, easy);
+
+        auto tit = transfers.find(easy);
+        if (tit == transfers.end())
+        {
+          pool->release(easy);
+          continue;
+        }
+
+        auto& t = tit->second;
+        auto& set = *t.set;
+        HTTPResponse& response = *t.response;
+        auto& p = set.pending[t.index];
+
+        {
+          std::lock_guard<std::mutex> guard(hosts_mtx);
+          t.active = false;
+          t.host->active--;
+        }
+
+        auto delay =
+          retry_delay(easy, result, response, t.attempts, request_timeout);
+
+        if (result == CURLE_OK)
+          record_transfer(easy, response);
+
+        bool ok = result == CURLE_OK && response.status < 400;
+        if (ok)
+          latency_tracker().record(t.host_key, total_time(easy));
+        else
+          latency_tracker().record_failure(t.host_key);
+
+        if (delay && response.status == 429)
+          pause(*t.host, Clock::now() + *delay);
+
+        // Requests with further mirrors fail over instead of being retried.
+        if (delay && t.attempts < max_attempts && p.next_url == p.urls.size())
+        {
+          if (verbose)
+            log(fmt::format(
+              "Request {}:{}: {}; RETRY in {}ms",
+              set.id,
+              t.index,
+              retry_reason(result, response),
+              delay->count()));
+          response = {};
+          t.attempts++;
+          t.retry_ticket = next_ticket++;
+          timers.schedule(Clock::now() + *delay, Timer{easy, t.retry_ticket});
+          continue;
+        }
+
+        if (result != CURLE_OK)
+        {
+          if (verbose)
+            log(fmt::format(
+              "Request {}:{}: curl error: {}",
+              set.id,
+              t.index,
+              curl_easy_strerror(result)));
+        }
+        else
+        {
+          if (verbose)
+            log(fmt::format(
+              "Request {}:{}: complete: {} size {}",
+              set.id,
+              t.index,
+              response.status,
+              response.body.size()));
+        }
 
-    typedef std::unordered_map<HTTPRequestSetId, std::shared_ptr<MonitorThread>>
-      MonitorThreads;
+        auto set_ptr = t.set;
+        auto index = t.index;
+        auto r = std::move(*t.response);
+        std::erase(p.easies, easy);
+        pool->release(easy);
+        transfers.erase(tit);
 
-    MonitorThreads monitor_threads;
+        if (ok)
+          succeeded(set_ptr, index, std::move(r));
+        else
+          failed(set_ptr, index, std::move(r));
+      }
+    }
+
+    void complete(const std::shared_ptr<RequestSet>& set)
+    {
+      std::function<void(HTTPResponses&&)> callback;
 
-    typedef std::unordered_map<HTTPRequestSetId, TrackedRequests> Requests;
-    Requests requests;
+      {
+        std::lock_guard<std::mutex> guard(mtx);
+        if (--set->outstanding > 0 || set->cancelled)
+          return;
+        if (set->callback)
+        {
+          callback.swap(set->callback);
+          sets.erase(set->id);
+        }
+      }
 
-    std::unordered_map<HTTPRequestSetId, HTTPResponses> responses;
+      if (callback)
+        callback(std::move(set->responses));
+    }
   };
 
   AsynchronousHTTPClient::AsynchronousHTTPClient(
-    size_t request_timeout_, size_t max_attempts_, bool verbose_)
+    size_t request_timeout_,
+    size_t max_attempts_,
+    bool verbose_,
+    size_t connection_idle_timeout_,
+    bool http2_,
+    bool compression_,
+    const HTTPHostLimits& host_limits_)
   {
-    implementation = new CurlClient(request_timeout_, max_attempts_, verbose_);
+    implementation = new CurlClient(
+      request_timeout_,
+      max_attempts_,
+      verbose_,
+      connection_idle_timeout_,
+      http2_,
+      compression_,
+      host_limits_);
   }
 
   AsynchronousHTTPClient::~AsynchronousHTTPClient()
@@ -474,4 +1833,10 @@ namespace ravl
   {
     return static_cast<CurlClient*>(implementation)->erase(id);
   }
+
+  std::unordered_map<std::string, HTTPHostStatistics> AsynchronousHTTPClient::
+    host_statistics() const
+  {
+    return static_cast<CurlClient*>(implementation)->host_statistics();
+  }
 }
@@ -0,0 +1,110 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+// Stress benchmark for the request table of AttestationRequestTracker: each
+// thread keeps a window of requests in flight, and polls, reads, and erases
+// them. Attestations are trivial, so the throughput is bounded by the
+// tracker's bookkeeping.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <ravl/attestation.h>
+#include <ravl/request_tracker.h>
+#include <thread>
+#include <vector>
+
+using namespace ravl;
+
+class TrivialClaims : public Claims
+{
+public:
+  TrivialClaims() : Claims(Source::UNKNOWN) {}
+
+  virtual std::string to_json() const override
+  {
+    return "{}";
+  }
+};
+
+class TrivialAttestation : public Attestation
+{
+public:
+  virtual std::optional<HTTPRequests> prepare_endorsements(
+    const Options&) const override
+  {
+    return std::nullopt;
+  }
+
+  virtual std::shared_ptr<Claims> verify(
+    const Options&, const std::optional<HTTPResponses>&) const override
+  {
+    return std::make_shared<TrivialClaims>();
+  }
+};
+
+static double run(
+  size_t num_threads, size_t requests_per_thread, size_t window)
+{
+  AttestationRequestTracker tracker;
+  auto attestation = std::make_shared<TrivialAttestation>();
+  Options options;
+
+  auto worker = [&]() {
+    std::vector<AttestationRequestTracker::RequestID> ids;
+    ids.reserve(window);
+    for (size_t i = 0; i < requests_per_thread; i++)
+    {
+      ids.push_back(tracker.submit(options, attestation));
+      if (ids.size() == window || i + 1 == requests_per_thread)
+      {
+        for (auto id : ids)
+        {
+          if (!tracker.completed(id) || !tracker.result(id))
+            std::abort();
+          tracker.erase(id);
+        }
+        ids.clear();
+      }
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; i++)
+    threads.emplace_back(worker);
+  for (auto& t : threads)
+    t.join();
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  return num_threads * requests_per_thread / elapsed.count();
+}
+
+int main(int argc, const char* argv[])
+{
+  size_t requests_per_thread = argc > 1 ? std::atol(argv[1]) : 200000;
+  size_t window = argc > 2 ? std::atol(argv[2]) : 1000;
+  size_t max_threads = argc > 3 ?
+    std::atol(argv[3]) :
+    std::max(1u, std::thread::hardware_concurrency());
+
+  std::vector<size_t> thread_counts;
+  for (size_t n = 1; n < max_threads; n *= 2)
+    thread_counts.push_back(n);
+  thread_counts.push_back(max_threads);
+
+  printf("threads  requests/s  speedup\n");
+  double base = 0;
+  for (auto n : thread_counts)
+  {
+    double r = run(n, requests_per_thread, window);
+    if (n == 1)
+      base = r;
+    printf("%7zu  %10.0f  %7.2f\n", n, r, r / base);
+  }
+
+  return 0;
+}
@@ -2,8 +2,14 @@
 // Licensed under the MIT License.
 
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <ravl/attestation.h>
+#include <ravl/crypto.h>
+#include <ravl/endorsement_refresher.h>
+#include <ravl/endorsement_store.h>
 #include <ravl/http_client.h>
+#include <ravl/http_policy.h>
 #include <ravl/json.h>
 #include <ravl/oe.h>
 #include <ravl/ravl.h>
@@ -12,8 +18,13 @@
 #include <ravl/aci.h>
 #include <ravl/sgx.h>
 #include <ravl/util.h>
+#include <ravl/verdict_cache.h>
 #include <string>
 
+#ifdef __cpp_impl_coroutine
+#  include <ravl/verify_async.h>
+#endif
+
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest.h>
 
@@ -24,6 +35,60 @@ Options default_options = {
   .certificate_verification = {.ignore_time = true},
   .http_max_attempts = 25};
 
+// HTTP client for tests: answers each request with `respond` (by default
+// with an empty response), right away or, if `deferred`, when complete() is
+// called.
+class StubHTTPClient : public HTTPClient
+{
+public:
+  typedef std::function<HTTPResponse(const HTTPRequest&)> Responder;
+
+  StubHTTPClient(Responder respond_ = nullptr, bool deferred_ = false) :
+    respond(respond_),
+    deferred(deferred_)
+  {}
+
+  virtual HTTPRequestSetId submit(
+    HTTPRequests&& rs, std::function<void(HTTPResponses&&)>&& callback) override
+  {
+    sets.emplace_back(std::move(rs), std::move(callback));
+    if (!deferred)
+      complete();
+    return sets.size() - 1;
+  }
+
+  virtual bool is_complete(const HTTPRequestSetId& id) const override
+  {
+    return id < completed;
+  }
+
+  virtual void erase(const HTTPRequestSetId& id) override
+  {
+    erased.push_back(id);
+  }
+
+  // Answer the request sets submitted so far (`respond` may throw, like
+  // clients that fail a set if one of its requests fails)
+  void complete()
+  {
+    while (completed < sets.size())
+    {
+      auto& [rs, callback] = sets[completed++];
+      HTTPResponses responses;
+      for (const auto& r : rs)
+        responses.push_back(respond ? respond(r) : HTTPResponse());
+      callback(std::move(responses));
+    }
+  }
+
+  Responder respond;
+  bool deferred;
+  std::vector<std::pair<HTTPRequests, std::function<void(HTTPResponses&&)>>>
+    sets;
+  size_t completed = 0;
+  std::vector<HTTPRequestSetId> erased;
+};
+
 /* clang-format off */
 std::string oe_coffeelake_attestation = R"({
   "source": "openenclave",
@@ -168,6 +233,102 @@ TEST_CASE("SGX CoffeeLake")
     "bf8689a1fdb3828efa56d9f23a1524ec1f1641968a811165b704cf6178f7e00b");
 }
 
+TEST_CASE("SGX verified chain cache")
+{
+  auto att = parse_attestation(coffeelake_quote);
+  REQUIRE_NOTHROW(att->verify(default_options));
+  auto before = crypto::verified_chain_cache_statistics();
+  REQUIRE_NOTHROW(att->verify(default_options));
+  auto after = crypto::verified_chain_cache_statistics();
+
+  // PCK CRL issuer chain, TCB info issuer chain, and QE identity issuer chain
+  REQUIRE(after.hits == before.hits + 3);
+  REQUIRE(after.misses == before.misses);
+}
+
+TEST_CASE("SGX verdict cache")
+{
+  auto options = default_options;
+  options.cache_verdicts = true;
+  auto att = parse_attestation(coffeelake_quote);
+  auto& cache = verdict_cache();
+  auto platform = att->platform_id();
+
+  std::shared_ptr<ravl::Claims> claims, cached;
+  auto before = cache.statistics();
+  REQUIRE_NOTHROW(claims = verify_synchronized(att, options, http_client));
+  REQUIRE_NOTHROW(cached = verify_synchronized(att, options, http_client));
+  auto after = cache.statistics();
+  REQUIRE(after.hits == before.hits + 1);
+  REQUIRE(cached != claims);
+  REQUIRE(cached->to_json() == claims->to_json());
+
+  cache.invalidate(platform);
+  REQUIRE_NOTHROW(cached = verify_synchronized(att, options, http_client));
+  REQUIRE(cache.statistics().hits == after.hits);
+}
+
+TEST_CASE("Request tracker IDs")
+{
+  auto att = parse_attestation(coffeelake_quote);
+  AttestationRequestTracker tracker;
+
+  auto id = tracker.submit(default_options, att);
+  REQUIRE(tracker.wait(id) == AttestationRequestTracker::FINISHED);
+  REQUIRE(tracker.get_future(id).get() == tracker.result(id));
+  tracker.erase(id);
+  REQUIRE(tracker.state(id) == AttestationRequestTracker::ERROR);
+  REQUIRE(tracker.wait(id) == AttestationRequestTracker::ERROR);
+  REQUIRE_THROWS(tracker.get_future(id).get());
+
+  // The slot of the erased request is reused, but its ID is not.
+  auto id2 = tracker.submit(default_options, att);
+  REQUIRE(id2 != id);
+  REQUIRE(tracker.finished(id2));
+  REQUIRE(tracker.state(id) == AttestationRequestTracker::ERROR);
+  REQUIRE_THROWS(tracker.result(id));
+}
+
+TEST_CASE("Request tracker w/o endorsement requests")
+{
+  class NoClaims : public Claims
+  {
+  public:
+    NoClaims() : Claims(Source::UNKNOWN) {}
+
+    virtual std::string to_json() const override
+    {
+      return "{}";
+    }
+  };
+
+  // Needs no endorsements, but says so with an empty set of requests.
+  class EmptyRequestsAttestation : public Attestation
+  {
+  public:
+    virtual std::optional<HTTPRequests> prepare_endorsements(
+      const Options&) const override
+    {
+      return HTTPRequests{};
+    }
+
+    virtual std::shared_ptr<Claims> verify(
+      const Options&, const std::optional<HTTPResponses>&) const override
+    {
+      return std::make_shared<NoClaims>();
+    }
+  };
+
+  AttestationRequestTracker tracker;
+  auto client = std::make_shared<StubHTTPClient>(nullptr, true);
+  auto id = tracker.submit(
+    default_options, std::make_shared<EmptyRequestsAttestation>(), client);
+  REQUIRE(
+    tracker.wait_for(id, std::chrono::seconds(10)) ==
+    AttestationRequestTracker::FINISHED);
+  REQUIRE(client->sets.empty());
+}
+
 TEST_CASE("SGX CoffeeLake w/o endorsements")
 {
   auto options = default_options;
@@ -238,6 +399,422 @@ TEST_CASE("SGX with endorsements from cache")
   REQUIRE_NOTHROW(claims = verify_synchronized(att, options, http_client));
 }
 
+TEST_CASE("SGX collateral cache")
+{
+  auto options = default_options;
+  options.historical = true;
+  auto att = parse_attestation(coffeelake_quote);
+  att->endorsements = {};
+  REQUIRE_NOTHROW(verify_synchronized(att, options, http_client));
+
+  // The collateral for this FMSPC is now cached, so no downloads are required.
+  REQUIRE(!att->prepare_endorsements(options));
+  std::shared_ptr<ravl::Claims> claims;
+  REQUIRE_NOTHROW(claims = att->verify(options));
+  REQUIRE(claims != nullptr);
+
+  options.fresh_endorsements = true;
+  REQUIRE(att->prepare_endorsements(options));
+}
+
+TEST_CASE("Endorsement store")
+{
+  using namespace std::chrono;
+  auto path = std::string("endorsement_store_test.bin");
+  std::remove(path.c_str());
+  auto now = system_clock::now();
+
+  HTTPRequests requests = {{"https://a"}, {"https://b"}};
+  HTTPResponses responses(2);
+  responses[0] = {.status = 200, .headers = {{"X-Chain", "abc"}}, .body = "1"};
+  responses[1] = {.status = 200, .body = std::string(1000, 'x')};
+
+  {
+    EndorsementStore store(path);
+    store.insert(requests, responses, now + hours(1));
+    store.insert("https://c", responses[0], now - hours(1));
+    REQUIRE(store.size() == 2);
+  }
+
+  EndorsementStore store(path);
+  REQUIRE(store.size() == 2);
+
+  // Responses that are stored already are not appended again.
+  auto file_size = std::filesystem::file_size(path);
+  store.insert(requests, responses, now + hours(1));
+  REQUIRE(std::filesystem::file_size(path) == file_size);
+
+  auto r = store.find(requests);
+  REQUIRE(r);
+  REQUIRE(r->at(0).get_header_string("X-Chain") == "abc");
+  REQUIRE(r->at(1).body == responses[1].body);
+  REQUIRE(!store.find("https://c"));
+
+  responses[0].body = "2";
+  store.insert("https://a", responses[0], now + hours(1));
+  store.compact();
+  REQUIRE(store.size() == 2);
+  REQUIRE(EndorsementStore(path).find("https://a")->body == "2");
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Endorsement refresher")
+{
+  using namespace std::chrono;
+
+  EndorsementRefreshSchedule schedule;
+  std::atomic<size_t> renewals = 0;
+
+  std::function<void(system_clock::time_point)> schedule_task =
+    [&](system_clock::time_point expiry) {
+      schedule.schedule(
+        "test",
+        expiry,
+        []() { return HTTPRequests{{"https://a"}}; },
+        [&](HTTPResponses&& responses) {
+          if (responses.at(0).body == "https://a")
+            renewals++;
+          schedule_task(system_clock::now() + hours(24));
+        });
+    };
+
+  schedule_task(system_clock::now() + seconds(30));
+
+  {
+    EndorsementRefresher refresher(
+      std::make_shared<StubHTTPClient>([](const HTTPRequest& r) {
+        return HTTPResponse{.status = 200, .body = r.url};
+      }),
+      minutes(1),
+      schedule);
+    for (size_t i = 0; i < 100 && renewals == 0; i++)
+      std::this_thread::sleep_for(milliseconds(10));
+    refresher.refresh();
+  }
+
+  REQUIRE(renewals == 1);
+  REQUIRE(schedule.size() == 1);
+  REQUIRE(*schedule.next_due(minutes(1)) > system_clock::now() + hours(23));
+
+  // Renewals in flight when the refresher is destroyed are retried later.
+  EndorsementRefreshSchedule pending;
+  pending.schedule(
+    "test",
+    system_clock::now() + seconds(30),
+    []() { return HTTPRequests{{"https://a"}}; },
+    [](HTTPResponses&&) {});
+
+  auto client = std::make_shared<StubHTTPClient>(nullptr, true);
+  {
+    EndorsementRefresher refresher(client, minutes(1), pending);
+    for (size_t i = 0; i < 100 && pending.next_due(minutes(1)); i++)
+      std::this_thread::sleep_for(milliseconds(10));
+    REQUIRE(!pending.next_due(minutes(1)));
+  }
+
+  REQUIRE(client->sets.size() == 1);
+  REQUIRE(client->erased.size() == 1);
+  REQUIRE(pending.next_due(minutes(1)));
+}
+
+TEST_CASE("Conditional endorsement renewal")
+{
+  using namespace std::chrono;
+
+  EndorsementRefreshSchedule schedule;
+  size_t consumed = 0;
+
+  auto previous = std::make_shared<HTTPResponses>(1);
+  previous->at(0).status = 200;
+  previous->at(0).headers["etag"] = "\"1234\"";
+  previous->at(0).body = "cached";
+
+  schedule.schedule(
+    "test",
+    system_clock::now() + seconds(30),
+    []() { return HTTPRequests{{"https://a"}}; },
+    [&](HTTPResponses&&) { consumed++; },
+    previous);
+
+  {
+    EndorsementRefresher refresher(
+      std::make_shared<StubHTTPClient>([](const HTTPRequest& r) {
+        return HTTPResponse{.status = is_conditional(r) ? 304u : 200u};
+      }),
+      minutes(1),
+      schedule);
+    refresher.refresh();
+  }
+
+  REQUIRE(consumed == 0);
+  REQUIRE(schedule.size() == 1);
+
+  HTTPRequest request("https://a");
+  REQUIRE(make_conditional(request, previous->at(0)));
+  REQUIRE(request.headers.at("If-None-Match") == "\"1234\"");
+}
+
+TEST_CASE("HTTP headers")
+{
+  REQUIRE(header_name_equal("Content-Length", "content-length"));
+  REQUIRE(header_name_equal("ETAG", "etag"));
+  REQUIRE(header_name_equal("", ""));
+  REQUIRE(!header_name_equal("ETag", "ETags"));
+  REQUIRE(!header_name_equal("ETag", "E-Tag"));
+  REQUIRE(!header_name_equal("X-[", "X-{"));
+  REQUIRE(!header_name_equal("\xC4", "\xE4"));
+
+  HTTPHeaders headers = {{"Content-Type", "text/plain"}};
+  REQUIRE(headers.size() == 1);
+  REQUIRE(*headers.find("content-type") == "text/plain");
+  REQUIRE(headers.contains("CONTENT-TYPE"));
+  REQUIRE(!headers.find("Content"));
+
+  // The first header of a name wins, and names keep their spelling.
+  REQUIRE(headers.emplace("ETag", "\"1\""));
+  REQUIRE(!headers.emplace("etag", "\"2\""));
+  REQUIRE(*headers.find("ETAG") == "\"1\"");
+  REQUIRE(headers.size() == 2);
+  REQUIRE(std::next(headers.begin())->first == "ETag");
+
+  headers["etag"] = "\"3\"";
+  REQUIRE(*headers.find("ETag") == "\"3\"");
+  REQUIRE(headers["X-New"].empty());
+  REQUIRE(headers.size() == 3);
+
+  HTTPResponse response;
+  response.headers = headers;
+  REQUIRE(response.get_header_string("x-new").empty());
+  REQUIRE(response.find_header("content-TYPE"));
+  REQUIRE_THROWS(response.get_header_string("Missing"));
+
+  headers.clear();
+  REQUIRE(headers.empty());
+}
+
+TEST_CASE("Conditional requests")
+{
+  auto header = parse_header_line("ETag:  \"1234\" \r\n");
+  REQUIRE(header);
+  REQUIRE(header->first == "ETag");
+  REQUIRE(header->second == "\"1234\"");
+  REQUIRE(parse_header_line("X-Empty:\r\n")->second.empty());
+  REQUIRE(!parse_header_line("HTTP/1.1 200 OK\r\n"));
+  REQUIRE(!parse_header_line("HTTP/1.1 500 Error: none\r\n"));
+  REQUIRE(!parse_header_line("\r\n"));
+
+  HTTPResponse previous;
+  previous.status = 200;
+  previous.body = "cached";
+
+  // Without validators, requests cannot be conditional.
+  HTTPRequest request("https://a");
+  REQUIRE(!make_conditional(request, previous));
+  REQUIRE(!is_conditional(request));
+
+  previous.headers["last-modified"] = "Wed, 21 Oct 2015 07:28:00 GMT";
+  REQUIRE(make_conditional(request, previous));
+  REQUIRE(is_conditional(request));
+  REQUIRE(
+    request.headers.at("If-Modified-Since") ==
+    "Wed, 21 Oct 2015 07:28:00 GMT");
+  REQUIRE(!request.headers.contains("If-None-Match"));
+
+  previous.headers["ETag"] = "\"1234\"";
+  REQUIRE(make_conditional(request, previous));
+  REQUIRE(request.headers.at("If-None-Match") == "\"1234\"");
+
+  // All resources unmodified: the previous responses stand in for the 304s.
+  HTTPResponses previous_set = {previous, previous};
+  HTTPResponses responses(2);
+  responses[0].status = responses[1].status = 304;
+  REQUIRE(revalidate(responses, previous_set));
+  REQUIRE(responses[0].body == "cached");
+  REQUIRE(responses[1].status == 200);
+
+  // Some resources modified: the others are still filled in.
+  responses = HTTPResponses(2);
+  responses[0].status = 304;
+  responses[1].status = 200;
+  responses[1].body = "new";
+  REQUIRE(!revalidate(responses, previous_set));
+  REQUIRE(responses[0].body == "cached");
+  REQUIRE(responses[1].body == "new");
+
+  // Responses to a different set of requests are left alone.
+  responses = HTTPResponses(1);
+  responses[0].status = 304;
+  REQUIRE(!revalidate(responses, previous_set));
+  REQUIRE(responses[0].status == 304);
+}
+
+TEST_CASE("HTTP transfer statistics")
+{
+  HTTPTransferStatistics s;
+  s.wire_bytes = 100;
+  s.body_bytes = 250;
+  REQUIRE(s.saved_bytes() == 150);
+  s.wire_bytes = 300;
+  REQUIRE(s.saved_bytes() == 0);
+
+  // A local transfer (file://) is counted like any other response.
+  auto path = std::filesystem::temp_directory_path() / "ravl_transfer_test";
+  {
+    std::ofstream f(path, std::ios::binary);
+    f << std::string(1000, 'x');
+  }
+
+  auto before = http_transfer_statistics();
+  auto response =
+    SynchronousHTTPClient::execute_synchronous("file://" + path.string());
+  auto after = http_transfer_statistics();
+  std::filesystem::remove(path);
+
+  REQUIRE(response.body.size() == 1000);
+  REQUIRE(after.responses == before.responses + 1);
+  REQUIRE(after.body_bytes == before.body_bytes + 1000);
+  REQUIRE(after.wire_bytes == before.wire_bytes + 1000);
+}
+
+TEST_CASE("Concurrent synchronous requests")
+{
+  auto dir = std::filesystem::temp_directory_path();
+  HTTPRequests requests;
+  for (size_t i = 0; i < 3; i++)
+  {
+    auto path = dir / ("ravl_request_set_test_" + std::to_string(i));
+    std::ofstream(path, std::ios::binary) << std::string(i + 1, 'x');
+    requests.emplace_back("file://" + path.string());
+  }
+
+  // Responses are in the order of the requests.
+  auto responses = SynchronousHTTPClient::execute_synchronous(requests);
+  REQUIRE(responses.size() == 3);
+  for (size_t i = 0; i < 3; i++)
+    REQUIRE(responses[i].body == std::string(i + 1, 'x'));
+
+  // A failed request fails the set (and its handles are returned to their
+  // pools, so the set can be executed again).
+  requests.emplace_back("file://" + (dir / "ravl_no_such_file").string());
+  REQUIRE_THROWS(SynchronousHTTPClient::execute_synchronous(requests, 0, 1));
+  requests.pop_back();
+  REQUIRE(SynchronousHTTPClient::execute_synchronous(requests).size() == 3);
+
+  for (const auto& r : requests)
+    std::filesystem::remove(r.url.substr(7));
+}
+
+TEST_CASE("HTTP retry delays")
+{
+  using namespace std::chrono;
+
+  // Exponential back-off from retry_base_delay, jittered into [d/2, d] and
+  // capped at retry_max_delay
+  for (size_t attempt = 1; attempt < 20; attempt++)
+  {
+    auto d = milliseconds(retry_max_delay);
+    if (attempt < 16)
+      d = std::min(d, retry_base_delay * (1 << (attempt - 1)));
+    for (size_t i = 0; i < 5; i++)
+    {
+      auto delay = retry_backoff_delay(attempt);
+      REQUIRE(delay >= d / 2);
+      REQUIRE(delay <= d);
+    }
+  }
+  REQUIRE(retry_backoff_delay(0) <= retry_base_delay);
+  REQUIRE(retry_backoff_delay(1) >= retry_base_delay / 2);
+
+  REQUIRE(parse_retry_after("120") == seconds(120));
+  REQUIRE(parse_retry_after(" 0 ") == seconds(0));
+  REQUIRE(!parse_retry_after(""));
+  REQUIRE(!parse_retry_after("-1"));
+  REQUIRE(!parse_retry_after("10s"));
+  REQUIRE(!parse_retry_after("Wed, 21 Oct 2015 07:28:00 GMT"));
+  REQUIRE(parse_retry_after("99999999999999999999999") == std::nullopt);
+  REQUIRE(parse_retry_after("9999999999999") == seconds(9999999999999));
+
+  // Delays requested by servers are capped.
+  REQUIRE(cap_retry_after(seconds(5), 0) == seconds(5));
+  REQUIRE(cap_retry_after(seconds(3600), 0) == retry_max_delay);
+  REQUIRE(cap_retry_after(seconds(3600), 10) == seconds(10));
+  REQUIRE(cap_retry_after(seconds(5), 10) == seconds(5));
+  REQUIRE(
+    cap_retry_after(*parse_retry_after("9999999999999"), 0) ==
+    retry_max_delay);
+}
+
+TEST_CASE("HTTP request rate limit")
+{
+  using namespace std::chrono;
+  auto t0 = TokenBucket::Clock::now();
+
+  // A burst of 3 requests, then one every 500ms.
+  TokenBucket bucket(2, 3, t0);
+  for (size_t i = 0; i < 3; i++)
+    REQUIRE(bucket.try_take(t0));
+  REQUIRE(!bucket.try_take(t0));
+  REQUIRE(bucket.available_at() == t0 + milliseconds(500));
+  REQUIRE(!bucket.try_take(t0 + milliseconds(499)));
+  REQUIRE(bucket.try_take(t0 + milliseconds(500)));
+  REQUIRE(!bucket.try_take(t0 + milliseconds(500)));
+
+  // Tokens do not accumulate beyond the burst size.
+  auto t1 = t0 + hours(1);
+  for (size_t i = 0; i < 3; i++)
+    REQUIRE(bucket.try_take(t1));
+  REQUIRE(!bucket.try_take(t1));
+
+  // No rate, no limit
+  TokenBucket unlimited;
+  for (size_t i = 0; i < 100; i++)
+    REQUIRE(unlimited.try_take(t0));
+}
+
+TEST_CASE("Mirror latency estimates")
+{
+  using us = LatencyTracker::Duration;
+  LatencyTracker tracker;
+  auto host_of = [](const std::string& url) { return url.substr(8); };
+
+  REQUIRE(!tracker.ewma("a"));
+  REQUIRE(!tracker.p95("a"));
+
+  tracker.record("a", us(100));
+  REQUIRE(tracker.ewma("a") == us(100));
+  tracker.record("a", us(200));
+  REQUIRE(tracker.ewma("a") == us(120));
+
+  // The 95th percentile needs a few samples.
+  for (size_t i = 2; i < LatencyTracker::min_samples - 1; i++)
+    tracker.record("a", us(100));
+  REQUIRE(!tracker.p95("a"));
+  tracker.record("a", us(100));
+  REQUIRE(tracker.p95("a") == us(200));
+
+  for (size_t i = 0; i < 2 * LatencyTracker::window; i++)
+    tracker.record("b", us(i + 1));
+  REQUIRE(
+    tracker.p95("b") ==
+    us(2 * LatencyTracker::window - LatencyTracker::window * 5 / 100));
+
+  // Hosts without estimates (in their given order), then the fastest first,
+  // and hosts that failed last
+  for (size_t i = 0; i < LatencyTracker::window; i++)
+    tracker.record("a", us(1000));
+  std::vector<std::string> urls = {
+    "https://x", "https://a", "https://b", "https://y"};
+  std::vector<std::string> expected = {
+    "https://x", "https://y", "https://b", "https://a"};
+  REQUIRE(tracker.order(urls, host_of) == expected);
+  tracker.record_failure("b");
+  expected = {"https://x", "https://y", "https://a", "https://b"};
+  REQUIRE(tracker.order(urls, host_of) == expected);
+  tracker.record("b", us(1));
+  REQUIRE(tracker.order(urls, host_of)[2] == "https://b");
+}
+
 TEST_CASE("SEV/SNP")
 {
   auto att = parse_attestation(sev_snp_quote);
@@ -260,6 +837,23 @@ TEST_CASE("SEV/SNP w/o endorsements")
     claims = verify_synchronized(att, default_options, http_client));
 }
 
+TEST_CASE("SEV/SNP VCEK cache")
+{
+  auto options = default_options;
+  auto att = parse_attestation(sev_snp_quote);
+  att->endorsements = {};
+  REQUIRE_NOTHROW(verify_synchronized(att, options, http_client));
+
+  // The VCEK and its issuer chain are now cached, so no downloads are required.
+  REQUIRE(!att->prepare_endorsements(options));
+  std::shared_ptr<ravl::Claims> claims;
+  REQUIRE_NOTHROW(claims = att->verify(options));
+  REQUIRE(claims != nullptr);
+
+  options.fresh_endorsements = true;
+  REQUIRE(att->prepare_endorsements(options));
+}
+
 TEST_CASE("SEV/SNP with endorsements from cache")
 {
   auto att = parse_attestation(sev_snp_quote);
@@ -400,6 +994,243 @@ TEST_CASE("SEV/SNP asynchronous")
     "490dbd61687de101b66ed1");
 }
 
+TEST_CASE("Coalesced endorsement downloads")
+{
+  auto options = default_options;
+  options.cache_endorsements = false;
+  auto att = parse_attestation(coffeelake_quote);
+  att->endorsements = {};
+
+  auto client = std::make_shared<StubHTTPClient>(nullptr, true);
+  AttestationRequestTracker tracker({.threads = 2});
+  std::vector<AttestationRequestTracker::RequestID> ids;
+  for (size_t i = 0; i < 10; i++)
+    ids.push_back(tracker.submit(options, att, client));
+
+  REQUIRE(client->sets.size() == 1);
+  for (auto id : ids)
+    REQUIRE(
+      tracker.state(id) ==
+      AttestationRequestTracker::WAITING_FOR_ENDORSEMENTS);
+  REQUIRE(
+    tracker.wait_for(ids[0], std::chrono::milliseconds(10)) ==
+    AttestationRequestTracker::WAITING_FOR_ENDORSEMENTS);
+
+  // Requests via another client don't share the downloads, and downloads
+  // that nobody else waits for are cancelled when their request is erased.
+  auto other_client = std::make_shared<StubHTTPClient>(nullptr, true);
+  auto other_id = tracker.submit(options, att, other_client);
+  REQUIRE(other_client->sets.size() == 1);
+  tracker.erase(other_id);
+  REQUIRE(other_client->erased.size() == 1);
+  tracker.erase(ids.back());
+  ids.pop_back();
+  REQUIRE(client->erased.empty());
+
+  auto future = tracker.get_future(ids[0]);
+  std::thread t([&client]() { client->complete(); });
+
+  // The (empty) responses have been delivered to all requests.
+  REQUIRE(tracker.wait(ids[0]) == AttestationRequestTracker::ERROR);
+  REQUIRE_THROWS(future.get());
+  t.join();
+  for (auto id : ids)
+    REQUIRE(tracker.wait(id) == AttestationRequestTracker::ERROR);
+}
+
+TEST_CASE("Batch verification")
+{
+  AttestationRequestTracker tracker;
+
+  std::vector<std::shared_ptr<const Attestation>> atts = {
+    parse_attestation(coffeelake_quote),
+    parse_attestation(sev_snp_quote),
+    nullptr,
+    parse_attestation(coffeelake_quote)};
+  auto r = tracker.verify_batch(atts, default_options);
+  REQUIRE(r.claims.size() == 4);
+  REQUIRE(r.claims[0]->source == Source::SGX);
+  REQUIRE(r.claims[1]->source == Source::SEV_SNP);
+  REQUIRE(!r.claims[2]);
+  REQUIRE(!r.errors[2].empty());
+  REQUIRE(r.claims[3]->source == Source::SGX);
+  REQUIRE(r.statistics.endorsement_sets == 0);
+
+  // Attestations that need the same endorsements share one download.
+  auto options = default_options;
+  options.cache_endorsements = false;
+  auto att = parse_attestation(coffeelake_quote);
+  att->endorsements = {};
+  atts = {att, att, att};
+  auto client = std::make_shared<StubHTTPClient>();
+  r = tracker.verify_batch(atts, options, client);
+  REQUIRE(client->sets.size() == 1);
+  REQUIRE(r.statistics.endorsement_sets == 1);
+  for (size_t i = 0; i < atts.size(); i++)
+  {
+    REQUIRE(!r.claims[i]);
+    REQUIRE(!r.errors[i].empty());
+  }
+
+  // Different endorsement sets are downloaded as one request set.
+  auto snp_att = parse_attestation(sev_snp_quote);
+  snp_att->endorsements = {};
+  atts = {att, snp_att};
+  client = std::make_shared<StubHTTPClient>();
+  r = tracker.verify_batch(atts, options, client);
+  REQUIRE(client->sets.size() == 1);
+  REQUIRE(r.statistics.endorsement_sets == 2);
+  REQUIRE(
+    client->sets[0].first.size() ==
+    att->prepare_endorsements(options)->size() +
+      snp_att->prepare_endorsements(options)->size());
+
+  // A failed download fails only the attestations that need it.
+  client = std::make_shared<StubHTTPClient>([](const HTTPRequest& request) {
+    if (request.url.find("amd.com") != std::string::npos)
+      throw std::runtime_error("HTTP 404");
+    return HTTPResponse{.status = 200};
+  });
+  atts = {att, snp_att, att};
+  r = tracker.verify_batch(atts, options, client);
+  REQUIRE(r.statistics.endorsement_sets == 2);
+  REQUIRE(client->sets.size() == 3);
+  REQUIRE(r.errors[1].find("endorsement download failed") == 0);
+  for (auto i : {0, 2})
+  {
+    REQUIRE(!r.errors[i].empty());
+    REQUIRE(r.errors[i].find("endorsement download failed") != 0);
+  }
+
+  // Batches on a tracker with a verification pool
+  AttestationRequestTracker pooled({.threads = 4});
+  atts.clear();
+  for (size_t i = 0; i < 16; i++)
+    atts.push_back(parse_attestation(coffeelake_quote));
+  for (size_t n = 0; n < 10; n++)
+  {
+    r = pooled.verify_batch(atts, default_options);
+    for (size_t i = 0; i < atts.size(); i++)
+      REQUIRE(r.claims[i]);
+  }
+
+  // Batches may be verified from a worker of a single-threaded verification
+  // pool (here, in the continuation of a request).
+  AttestationRequestTracker single({.threads = 1});
+  client = std::make_shared<StubHTTPClient>(nullptr, true);
+  auto id = single.submit(options, att, client);
+  std::promise<size_t> verified;
+  single.when_complete(id, [&](AttestationRequestTracker::RequestState) {
+    atts = {
+      parse_attestation(coffeelake_quote), parse_attestation(coffeelake_quote)};
+    auto batch = single.verify_batch(atts, default_options);
+    verified.set_value(std::count(
+      batch.errors.begin(), batch.errors.end(), std::string()));
+  });
+  client->complete();
+  auto future = verified.get_future();
+  REQUIRE(
+    future.wait_for(std::chrono::seconds(60)) == std::future_status::ready);
+  REQUIRE(future.get() == 2);
+  single.erase(id);
+}
+
+TEST_CASE("Worker pool")
+{
+  std::atomic<size_t> count = 0;
+
+  {
+    WorkerPool pool({.threads = 4});
+    for (size_t i = 0; i < 100; i++)
+      pool.submit([&pool, &count]() {
+        count++;
+        for (size_t j = 0; j < 10; j++)
+          pool.submit([&count]() { count++; });
+      });
+  }
+
+  REQUIRE(count == 1100);
+}
+
+#ifdef __cpp_impl_coroutine
+// Minimal eagerly started coroutine
+struct Task
+{
+  struct promise_type
+  {
+    Task get_return_object()
+    {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept
+    {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept
+    {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() {}
+  };
+};
+
+TEST_CASE("Coroutine verification")
+{
+  std::shared_ptr<Claims> claims;
+  bool done = false, failed = false;
+  auto verify = [&](
+                  std::shared_ptr<const Attestation> att,
+                  const Options& options,
+                  std::shared_ptr<HTTPClient> client,
+                  VerificationExecutor executor,
+                  AttestationRequestTracker& tracker) -> Task {
+    try
+    {
+      claims = co_await verify_async(att, options, client, executor, tracker);
+    }
+    catch (const std::exception&)
+    {
+      failed = true;
+    }
+    done = true;
+  };
+
+  // Endorsements included: completes without suspending.
+  auto att = parse_attestation(coffeelake_quote);
+  verify(att, default_options, nullptr, nullptr, async_request_tracker());
+  REQUIRE(done);
+  REQUIRE(claims);
+
+  // Endorsements to download: suspends until they arrive, and resumes via
+  // the executor (called right away, as the tracker has no verification
+  // pool).
+  auto options = default_options;
+  options.cache_endorsements = false;
+  att = parse_attestation(coffeelake_quote);
+  att->endorsements = {};
+  auto client = std::make_shared<StubHTTPClient>(nullptr, true);
+  AttestationRequestTracker tracker;
+  std::vector<std::coroutine_handle<>> queue;
+  done = false;
+  verify(
+    att,
+    options,
+    client,
+    [&queue](std::coroutine_handle<> h) { queue.push_back(h); },
+    tracker);
+  REQUIRE(!done);
+  REQUIRE(client->sets.size() == 1);
+
+  client->complete();
+  REQUIRE(!done);
+  REQUIRE(queue.size() == 1);
+  queue[0].resume();
+  REQUIRE(done);
+  REQUIRE(failed);
+}
+#endif
+
 TEST_CASE("Open Enclave CoffeeLake JSON claims")
 {
   auto att = parse_attestation(oe_coffeelake_attestation);
@@ -3,6 +3,7 @@
 
 #include "ravl/http_client.h"
 
+#include <atomic>
 #include <cstring>
 #include <emscripten/fetch.h>
 #include <new>
@@ -21,16 +22,69 @@ namespace ravl
     const HTTPRequest& request,
     size_t timeout,
     size_t max_attempts,
-    bool verbose)
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression)
   {
     throw std::runtime_error("synchronous fetch not supported");
   }
 
+  HTTPResponses SynchronousHTTPClient::execute_synchronous(
+    const HTTPRequests& requests,
+    size_t timeout,
+    size_t max_attempts,
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression)
+  {
+    throw std::runtime_error("synchronous fetch not supported");
+  }
+
+  // The browser decompresses response bodies transparently, so the number of
+  // bytes on the wire is not known and the body size is counted instead.
+  static struct
+  {
+    std::atomic<uint64_t> responses = 0;
+    std::atomic<uint64_t> body_bytes = 0;
+  } transfer_statistics;
+
+  HTTPTransferStatistics http_transfer_statistics()
+  {
+    HTTPTransferStatistics r;
+    r.responses = transfer_statistics.responses;
+    r.wire_bytes = transfer_statistics.body_bytes;
+    r.body_bytes = transfer_statistics.body_bytes;
+    return r;
+  }
+
+  // "host:port" of a URL
+  static std::string host_of(const std::string& url)
+  {
+    auto scheme_end = url.find("://");
+    if (scheme_end == std::string::npos)
+      return "";
+    auto scheme = url.substr(0, scheme_end);
+    auto authority = url.substr(scheme_end + 3);
+    authority = authority.substr(0, authority.find_first_of("/?#"));
+    authority = authority.substr(authority.find('@') + 1);
+    if (authority.find(':', authority.rfind(']') + 1) != std::string::npos)
+      return authority;
+    return authority + (scheme == "http" ? ":80" : ":443");
+  }
+
+  // Connections, HTTP/2, and compression are managed by the browser, so the
+  // corresponding options are ignored. Host limits are not enforced either,
+  // but the per-host statistics are kept.
   class FetchTracker : public HTTPClient
   {
   public:
-    FetchTracker(size_t request_timeout = 0, bool verbose = false) :
-      HTTPClient(request_timeout, verbose)
+    FetchTracker(
+      size_t request_timeout = 0,
+      size_t max_attempts = 5,
+      bool verbose = false) :
+      HTTPClient(request_timeout, max_attempts, verbose)
     {}
 
     struct UserData
@@ -99,6 +153,7 @@ namespace ravl
       for (size_t i = 0; i < reqs.requests.size(); i++)
       {
         auto& request = reqs.requests.at(i);
+        start(request.url);
         reqs.fetches.push_back(
           make_fetch("GET", this, id, i, request.url, request_timeout));
       }
@@ -131,6 +186,11 @@ namespace ravl
     {
       std::lock_guard<std::mutex> guard(mtx);
 
+      auto& host = hosts[host_of(fetch->url)];
+      host.active--;
+      if (fetch->status == 429)
+        host.throttled++;
+
       auto rqit = requests.find(id);
       if (rqit == requests.end())
         return;
@@ -152,8 +212,11 @@ namespace ravl
       HTTPResponse& response = rsit->second.at(i);
 
       if (must_retry(fetch, response, true))
+      {
+        start(fetch->url);
         treqs.fetches[i] =
           make_fetch("GET", this, id, i, fetch->url, request_timeout);
+      }
       else
       {
         response.status = fetch->status;
@@ -173,6 +236,8 @@ namespace ravl
         //   printf("|%s|=|%s|\n", kv.first.c_str(), kv.second.c_str());
 
         response.body = {fetch->data, static_cast<size_t>(fetch->numBytes)};
+        transfer_statistics.responses++;
+        transfer_statistics.body_bytes += response.body.size();
 
         printf(
           "Complete %zu: %u size %zu/%zu (req. %zu)\n",
@@ -223,9 +288,26 @@ namespace ravl
       responses.erase(id);
     }
 
+    std::unordered_map<std::string, HTTPHostStatistics> host_statistics()
+      const
+    {
+      std::lock_guard<std::mutex> guard(mtx);
+      return hosts;
+    }
+
   protected:
     mutable std::mutex mtx;
 
+    // Per-host statistics (by "host:port")
+    std::unordered_map<std::string, HTTPHostStatistics> hosts;
+
+    void start(const std::string& url)
+    {
+      auto& host = hosts[host_of(url)];
+      host.requests++;
+      host.active++;
+    }
+
     struct TrackedRequests
     {
       HTTPRequests requests = {};
@@ -240,9 +322,15 @@ namespace ravl
   };
 
   AsynchronousHTTPClient::AsynchronousHTTPClient(
-    size_t request_timeout, size_t max_attempts, bool verbose)
+    size_t request_timeout,
+    size_t max_attempts,
+    bool verbose,
+    size_t connection_idle_timeout,
+    bool http2,
+    bool compression,
+    const HTTPHostLimits& host_limits)
   {
-    implementation = new FetchTracker(request_timeout, verbose);
+    implementation = new FetchTracker(request_timeout, max_attempts, verbose);
   }
 
   AsynchronousHTTPClient::~AsynchronousHTTPClient()
@@ -266,4 +354,10 @@ namespace ravl
   {
     static_cast<FetchTracker*>(implementation)->erase(id);
   }
+
+  std::unordered_map<std::string, HTTPHostStatistics> AsynchronousHTTPClient::
+    host_statistics() const
+  {
+    return static_cast<FetchTracker*>(implementation)->host_statistics();
+  }
 }